@@ -0,0 +1,399 @@
+/*
+ * Timer accuracy benchmark with regression thresholds.
+ *
+ * Build:  gcc -O2 -I. accuracy_scheduler.c scheduler.c -lpthread -o accuracy_scheduler
+ * Run:    ./accuracy_scheduler [-s idle|loaded|bursty] [-q heap|wheel] [-m cond|loop]
+ *                              [-T secs] [-l p50,p99,p999,max] [-o file]
+ *
+ * Probe timers of 1 to 50ms are added at random sub-millisecond phases,
+ * each carrying its own absolute deadline, and the callback records how
+ * far from that deadline it ran. Every scenario runs on a fresh context
+ * with one dispatcher thread, either a spd_sched_cond_wait() loop or
+ * spd_sched_loop_run():
+ *
+ *   idle     only the probes
+ *   loaded   100k long background timers, a thread adding and deleting
+ *            them at 100k ops/s, and 1000 timers/s whose callbacks spin
+ *            for 20us on the dispatcher
+ *   bursty   on top of the probes, 1000 timers sharing one deadline
+ *            every 50ms, all of them measured
+ *
+ * Lateness p50/p99/p99.9/max and the number of timers fired before
+ * their deadline go to stdout (or -o) as one JSON record per scenario,
+ * after a "host" record of plain clock_nanosleep() lateness which shows
+ * how much of the tail is the machine rather than the scheduler.
+ * When a percentile exceeds its threshold, in us, the scenario is
+ * reported on stderr and the exit status is 1. -l replaces the built-in
+ * thresholds of every scenario run, 0 leaves one unchecked.
+ */
+#include "scheduler.h"
+#include "times.h"
+
+#include <errno.h>
+#include <time.h>
+
+#define ACC_PROBE_RATE   500     /*!< Probe timers per second */
+#define ACC_BURST        1000    /*!< Timers of one burst */
+#define ACC_BURST_EVERY  50      /*!< ms between bursts */
+#define ACC_BACKGROUND   100000  /*!< Long timers behind a loaded queue */
+#define ACC_CHURN_RATE   100000  /*!< Background adds and dels per second */
+#define ACC_BUSY_RATE    1000    /*!< Busy timers per second */
+#define ACC_BUSY_NS      20000   /*!< Time a busy callback spins */
+
+enum acc_scenario {
+    ACC_IDLE,
+    ACC_LOADED,
+    ACC_BURSTY,
+};
+
+enum acc_mode {
+    ACC_COND,
+    ACC_LOOP,
+};
+
+static const char *scenario_names[] = { "idle", "loaded", "bursty" };
+static const char *queue_names[] = { "heap", "wheel" };
+static const char *mode_names[] = { "cond", "loop" };
+
+/*! \brief Lateness thresholds in us, 0 is not checked */
+struct acc_limits {
+    long p50;
+    long p99;
+    long p999;
+    long max;
+};
+
+/*
+ * A millisecond lost to rounding shows in the median, so that limit is
+ * tight. The tails are left loose enough for a shared CI machine, where
+ * the host steals several milliseconds now and then.
+ */
+static const struct acc_limits default_limits[] = {
+    { 500, 5000, 10000, 50000 },       /* idle */
+    { 1000, 10000, 20000, 50000 },     /* loaded */
+    { 2000, 10000, 20000, 50000 },     /* bursty */
+};
+
+static struct {
+    struct scheduler_context *c;
+    enum acc_mode mode;
+    spd_ns_t *samples;        /*!< Lateness of every measured timer, ns, may be negative */
+    long nsamples;
+    long maxsamples;
+    spd_ns_t end;
+    int done;
+} acc;
+
+static uint64_t rng = 88172645463325252ULL;
+
+static uint64_t acc_rand(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+/*! \brief The payload is the absolute deadline of the timer */
+static int acc_probe_cb(void *data)
+{
+    spd_ns_t late = spd_nsnow() - *(spd_ns_t *)data;
+    long i = __atomic_fetch_add(&acc.nsamples, 1, __ATOMIC_RELAXED);
+
+    if (i < acc.maxsamples)
+        acc.samples[i] = late;
+    return 0;
+}
+
+static int acc_busy_cb(void *data)
+{
+    spd_ns_t end = spd_nsnow() + ACC_BUSY_NS;
+
+    (void)data;
+    while (spd_nsnow() < end)
+        ;
+    return 0;
+}
+
+static int acc_nop_cb(void *data)
+{
+    (void)data;
+    return 0;
+}
+
+/*! \brief Sleeps, rather than spins, so the load threads leave the dispatcher its CPU */
+static void acc_sleep_until(spd_ns_t t)
+{
+    struct timespec ts = { t / SPD_NS_PER_SEC, t % SPD_NS_PER_SEC };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static void acc_add_probe(int when)
+{
+    spd_ns_t deadline = spd_nsnow() + when * SPD_NS_PER_MS;
+
+    spd_sched_add_inline(acc.c, when, acc_probe_cb, &deadline, sizeof(deadline), 0, 1);
+}
+
+static void *acc_dispatcher_thread(void *data)
+{
+    (void)data;
+    if (acc.mode == ACC_LOOP)
+        return spd_sched_loop_run(acc.c) < 0 ? (void *)1 : NULL;
+    while (!__atomic_load_n(&acc.done, __ATOMIC_ACQUIRE)) {
+        if (spd_sched_cond_wait(acc.c) < 0)
+            break;
+        spd_sched_runall(acc.c);
+    }
+    return NULL;
+}
+
+/*! \brief Adds and deletes long timers at ACC_CHURN_RATE until the end, a millisecond's worth at a time */
+static void *acc_churn_thread(void *data)
+{
+    int *ids = data;
+    uint64_t r = 2654435761ULL;
+    spd_ns_t next = spd_nsnow();
+    unsigned int i, n;
+
+    while ((next += SPD_NS_PER_MS) < acc.end) {
+        for (n = 0; n < ACC_CHURN_RATE / 1000 / 2; n++) {
+            r ^= r << 13;
+            r ^= r >> 7;
+            r ^= r << 17;
+            i = r % ACC_BACKGROUND;
+            if (!spd_sched_del(acc.c, ids[i]))
+                ids[i] = spd_sched_add(acc.c, 10000 + r % 50000, acc_nop_cb, NULL);
+        }
+        acc_sleep_until(next);
+    }
+    return NULL;
+}
+
+static int cmp_ns(const void *a, const void *b)
+{
+    spd_ns_t x = *(const spd_ns_t *)a, y = *(const spd_ns_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*! \brief Lateness at percentile p of the sorted samples, in us, early counts as 0 */
+static long acc_percentile(double p)
+{
+    long i = (long)(acc.nsamples * p / 100);
+    spd_ns_t v = acc.samples[i < acc.nsamples ? i : acc.nsamples - 1];
+
+    return v > 0 ? v / 1000 : 0;
+}
+
+static int acc_check(const char *scenario, const char *name, long value, long limit)
+{
+    if (!limit || value <= limit)
+        return 0;
+    fprintf(stderr, "FAIL %s: lateness %s %ld us exceeds %ld us\n", scenario, name, value, limit);
+    return 1;
+}
+
+/*! \return the number of thresholds exceeded */
+static int acc_run(FILE *out, enum acc_scenario sc, enum spd_sched_queue type, int secs,
+    const struct acc_limits *lim)
+{
+    const char *name = scenario_names[sc];
+    pthread_t dispatcher, churn;
+    int *ids = NULL;
+    spd_ns_t start, next, burst, deadline;
+    long i, early = 0, p50, p99, p999, max;
+    int failed = 0;
+
+    acc.maxsamples = (long)secs * (ACC_PROBE_RATE + (sc == ACC_BURSTY ? ACC_BURST * 1000 / ACC_BURST_EVERY : 0)) + ACC_BURST;
+    acc.samples = malloc(acc.maxsamples * sizeof(*acc.samples));
+    acc.nsamples = 0;
+    acc.done = 0;
+    if (!acc.samples || !(acc.c = spd_sched_context_create_type(type))) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    if (sc == ACC_LOADED) {
+        if (!(ids = malloc(ACC_BACKGROUND * sizeof(*ids)))) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+        for (i = 0; i < ACC_BACKGROUND; i++)
+            ids[i] = spd_sched_add(acc.c, 10000 + acc_rand() % 50000, acc_nop_cb, NULL);
+    }
+    pthread_create(&dispatcher, NULL, acc_dispatcher_thread, NULL);
+
+    start = next = burst = spd_nsnow();
+    acc.end = start + secs * SPD_NS_PER_SEC;
+    if (sc == ACC_LOADED)
+        pthread_create(&churn, NULL, acc_churn_thread, ids);
+
+    /* probes at random phases, busy timers and bursts in between */
+    while (next < acc.end) {
+        next += SPD_NS_PER_SEC / ACC_PROBE_RATE / 2 + acc_rand() % (SPD_NS_PER_SEC / ACC_PROBE_RATE);
+        acc_add_probe(1 + acc_rand() % 50);
+        if (sc == ACC_LOADED) {
+            for (i = 0; i < ACC_BUSY_RATE / ACC_PROBE_RATE; i++)
+                spd_sched_add(acc.c, 1 + acc_rand() % 50, acc_busy_cb, NULL);
+        }
+        if (sc == ACC_BURSTY && next >= burst) {
+            /* one deadline for the whole burst, the last one of it is as late as the batch is long */
+            burst += ACC_BURST_EVERY * SPD_NS_PER_MS;
+            deadline = spd_nsnow() + 20 * SPD_NS_PER_MS;
+            for (i = 0; i < ACC_BURST; i++)
+                spd_sched_add_inline(acc.c, 20, acc_probe_cb, &deadline, sizeof(deadline), 0, 1);
+        }
+        acc_sleep_until(next);
+    }
+    if (sc == ACC_LOADED)
+        pthread_join(churn, NULL);
+
+    /* let the last probes fire, then take the dispatcher down */
+    usleep(100000);
+    __atomic_store_n(&acc.done, 1, __ATOMIC_RELEASE);
+    if (acc.mode == ACC_LOOP)
+        spd_sched_loop_stop(acc.c);
+    else
+        spd_sched_add(acc.c, 1, acc_nop_cb, NULL);
+    pthread_join(dispatcher, NULL);
+
+    if (acc.nsamples > acc.maxsamples)
+        acc.nsamples = acc.maxsamples;
+    if (!acc.nsamples) {
+        fprintf(stderr, "FAIL %s: no timer fired\n", name);
+        failed = 1;
+        p50 = p99 = p999 = max = 0;
+    } else {
+        qsort(acc.samples, acc.nsamples, sizeof(*acc.samples), cmp_ns);
+        for (i = 0; i < acc.nsamples && acc.samples[i] < 0; i++)
+            early++;
+        p50 = acc_percentile(50);
+        p99 = acc_percentile(99);
+        p999 = acc_percentile(99.9);
+        max = acc_percentile(100);
+        failed += acc_check(name, "p50", p50, lim->p50);
+        failed += acc_check(name, "p99", p99, lim->p99);
+        failed += acc_check(name, "p99.9", p999, lim->p999);
+        failed += acc_check(name, "max", max, lim->max);
+    }
+
+    fprintf(out, ",\n  {\"scenario\": \"%s\", \"queue\": \"%s\", \"mode\": \"%s\", \"secs\": %d, "
+        "\"timers\": %ld, \"early\": %ld, \"early_max_us\": %lld, "
+        "\"late_p50_us\": %ld, \"late_p99_us\": %ld, \"late_p999_us\": %ld, \"late_max_us\": %ld, "
+        "\"limit_p50_us\": %ld, \"limit_p99_us\": %ld, \"limit_p999_us\": %ld, \"limit_max_us\": %ld, "
+        "\"pass\": %s}",
+        name, queue_names[type], mode_names[acc.mode], secs, acc.nsamples, early,
+        early ? (long long)-acc.samples[0] / 1000 : 0LL, p50, p99, p999, max,
+        lim->p50, lim->p99, lim->p999, lim->max, failed ? "false" : "true");
+    fflush(out);
+    fprintf(stderr, "%-6s %-6s %-4s %7ld timers, early %ld, late p50 %ld p99 %ld p99.9 %ld max %ld us  %s\n",
+        name, queue_names[type], mode_names[acc.mode], acc.nsamples, early, p50, p99, p999, max,
+        failed ? "FAIL" : "ok");
+
+    spd_sche_context_destroy(acc.c);
+    free(acc.samples);
+    free(ids);
+    return failed;
+}
+
+/*! \brief
+ * Lateness of plain clock_nanosleep() calls for one second, no thresholds.
+ * This is the floor the host allows, as a reference for the scenarios.
+ */
+static void acc_host(FILE *out)
+{
+    spd_ns_t end = spd_nsnow() + SPD_NS_PER_SEC, deadline;
+
+    acc.maxsamples = SPD_NS_PER_SEC / (SPD_NS_PER_MS / 2);
+    if (!(acc.samples = malloc(acc.maxsamples * sizeof(*acc.samples)))) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    for (acc.nsamples = 0; acc.nsamples < acc.maxsamples && spd_nsnow() < end; acc.nsamples++) {
+        deadline = spd_nsnow() + SPD_NS_PER_MS / 2 + acc_rand() % SPD_NS_PER_MS;
+        acc_sleep_until(deadline);
+        acc.samples[acc.nsamples] = spd_nsnow() - deadline;
+    }
+    qsort(acc.samples, acc.nsamples, sizeof(*acc.samples), cmp_ns);
+    fprintf(out, "\n  {\"scenario\": \"host\", \"timers\": %ld, "
+        "\"late_p50_us\": %ld, \"late_p99_us\": %ld, \"late_p999_us\": %ld, \"late_max_us\": %ld}",
+        acc.nsamples, acc_percentile(50), acc_percentile(99), acc_percentile(99.9), acc_percentile(100));
+    fprintf(stderr, "host   sleep       %7ld sleeps, late p50 %ld p99 %ld p99.9 %ld max %ld us\n",
+        acc.nsamples, acc_percentile(50), acc_percentile(99), acc_percentile(99.9), acc_percentile(100));
+    free(acc.samples);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-s idle|loaded|bursty] [-q heap|wheel] [-m cond|loop] [-T secs] "
+        "[-l p50,p99,p999,max] [-o file]\n", prog);
+    exit(2);
+}
+
+static int lookup(const char *name, const char **names, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (!strcmp(name, names[i]))
+            return i;
+    }
+    return -1;
+}
+
+int main(int argc, char **argv)
+{
+    struct acc_limits limits, *lim = NULL;
+    int sfirst = 0, slast = 2, qfirst = 0, qlast = 1, secs = 3, failed = 0, opt, s, q;
+    FILE *out = stdout;
+
+    acc.mode = ACC_COND;
+    while ((opt = getopt(argc, argv, "s:q:m:T:l:o:")) != -1) {
+        switch (opt) {
+        case 's':
+            if ((sfirst = slast = lookup(optarg, scenario_names, 3)) < 0)
+                usage(argv[0]);
+            break;
+        case 'q':
+            if ((qfirst = qlast = lookup(optarg, queue_names, 2)) < 0)
+                usage(argv[0]);
+            break;
+        case 'm':
+            if ((s = lookup(optarg, mode_names, 2)) < 0)
+                usage(argv[0]);
+            acc.mode = s;
+            break;
+        case 'T':
+            if ((secs = atoi(optarg)) <= 0)
+                usage(argv[0]);
+            break;
+        case 'l':
+            if (sscanf(optarg, "%ld,%ld,%ld,%ld", &limits.p50, &limits.p99, &limits.p999, &limits.max) != 4)
+                usage(argv[0]);
+            lim = &limits;
+            break;
+        case 'o':
+            if (!(out = fopen(optarg, "w"))) {
+                perror(optarg);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    fprintf(out, "[");
+    acc_host(out);
+    for (s = sfirst; s <= slast; s++) {
+        for (q = qfirst; q <= qlast; q++)
+            failed += acc_run(out, s, q, secs, lim ? lim : &default_limits[s]);
+    }
+    fprintf(out, "\n]\n");
+    if (out != stdout)
+        fclose(out);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,402 @@
+/*
+ * Microbenchmarks of the scheduler.
+ *
+ * Build:  gcc -O2 -I. bench_scheduler.c scheduler.c -lpthread -o bench_scheduler
+ *         (add -DUSE_IO_URING to compare the io_uring wait loop as well)
+ * Run:    ./bench_scheduler [-q heap|wheel] [-d uniform|bimodal|cancel]
+ *                           [-s 1000,10000,...] [-k ops] [-w rate [-S slack]] [-o results.json]
+ *
+ * For every queue type, deadline distribution and queue size the queue
+ * is filled with background events, then 'ops' adds, whens, mods,
+ * del+add restarts and dels are timed one by one at that size, and a
+ * runall firing 'ops' due events is timed as a whole. The cancel
+ * distribution adds a churn op on top: a stream of adds where 9 in
+ * 10 delete a random live timer of the stream before it fires.
+ * Results go to stdout (or -o) as one JSON array, so a run can be
+ * kept as a baseline and compared with the next one.
+ *
+ * -w rate feeds 'rate' timers per second to one loop thread for two
+ * seconds and reports the CPU time of that thread and the lateness of
+ * the timers, for spd_sched_cond_wait() and spd_sched_uring_wait().
+ * -S gives those timers 'slack' ms of slack, the number of times the
+ * loop went to sleep shows how many wakeups that saves.
+ */
+#include "scheduler.h"
+#include "times.h"
+
+#include <time.h>
+
+#define BENCH_MAX_SIZES 16
+
+enum bench_dist {
+    BENCH_UNIFORM,      /*!< 1s to 60s */
+    BENCH_BIMODAL,      /*!< 80% keepalives around 30s, 20% retransmits of 0.5s to 16s */
+    BENCH_CANCEL,       /*!< uniform, 90% of the churn and runall events are deleted before they fire */
+};
+
+static const char *dist_names[] = { "uniform", "bimodal", "cancel" };
+static const char *queue_names[] = { "heap", "wheel" };
+
+static FILE *out;
+static int nresults;
+static spd_ns_t clock_cost;
+static int slack;
+static uint64_t rng = 88172645463325252ULL;
+
+static uint64_t bench_rand(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static int bench_when(enum bench_dist dist)
+{
+    if (dist == BENCH_BIMODAL) {
+        if (bench_rand() % 5)
+            return 25000 + bench_rand() % 10000;
+        return 500 << (bench_rand() % 6);
+    }
+    return 1000 + bench_rand() % 59000;
+}
+
+static int bench_cb(void *data)
+{
+    (void)data;
+    return 0;
+}
+
+static int cmp_ns(const void *a, const void *b)
+{
+    spd_ns_t x = *(const spd_ns_t *)a, y = *(const spd_ns_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void report(const char *queue, const char *dist, long size, const char *op, long ops,
+    double ns_per_op, spd_ns_t *samples)
+{
+    fprintf(out, "%s\n  {\"queue\": \"%s\", \"dist\": \"%s\", \"size\": %ld, \"op\": \"%s\", \"ops\": %ld, "
+        "\"ns_per_op\": %.1f, \"ops_per_sec\": %.0f",
+        nresults++ ? "," : "", queue, dist, size, op, ops, ns_per_op, ns_per_op > 0 ? 1e9 / ns_per_op : 0.0);
+    if (samples) {
+        qsort(samples, ops, sizeof(*samples), cmp_ns);
+        fprintf(out, ", \"p50_ns\": %lld, \"p99_ns\": %lld, \"p999_ns\": %lld, \"max_ns\": %lld",
+            (long long)samples[ops / 2], (long long)samples[ops * 99 / 100],
+            (long long)samples[ops * 999 / 1000], (long long)samples[ops - 1]);
+    }
+    fprintf(out, "}");
+    fprintf(stderr, "%-6s %-8s %9ld %-7s %10.1f ns/op", queue, dist, size, op, ns_per_op);
+    if (samples)
+        fprintf(stderr, "  p99 %lld ns", (long long)samples[ops * 99 / 100]);
+    fprintf(stderr, "\n");
+}
+
+/*! \brief Time of one op, without the cost of reading the clock */
+static spd_ns_t lap(spd_ns_t start)
+{
+    spd_ns_t d = spd_nsnow() - start - clock_cost;
+
+    return d > 0 ? d : 0;
+}
+
+static double mean(const spd_ns_t *samples, long n)
+{
+    double sum = 0;
+    long i;
+
+    for (i = 0; i < n; i++)
+        sum += samples[i];
+    return n ? sum / n : 0;
+}
+
+static void bench_size(enum spd_sched_queue type, enum bench_dist dist, long size, long ops)
+{
+    const char *q = queue_names[type], *d = dist_names[dist];
+    struct scheduler_context *c = spd_sched_context_create_type(type);
+    spd_ns_t *samples = malloc(ops * sizeof(*samples));
+    int *ids = malloc(size * sizeof(*ids));
+    int *opids = malloc(ops * sizeof(*opids));
+    spd_ns_t t;
+    long i, n;
+
+    if (!c || !samples || !ids || !opids) {
+        fprintf(stderr, "out of memory at size %ld\n", size);
+        exit(1);
+    }
+
+    t = spd_nsnow();
+    for (i = 0; i < size; i++)
+        ids[i] = spd_sched_add_flag(c, bench_when(dist), bench_cb, NULL, 0, 1);
+    report(q, d, size, "fill", size, (double)(spd_nsnow() - t) / size, NULL);
+
+    for (i = 0; i < ops; i++) {
+        int when = bench_when(dist);
+
+        t = spd_nsnow();
+        opids[i] = spd_sched_add_flag(c, when, bench_cb, NULL, 0, 1);
+        samples[i] = lap(t);
+    }
+    report(q, d, size, "add", ops, mean(samples, ops), samples);
+
+    if (dist == BENCH_CANCEL) {
+        /* timeouts that mostly get cancelled: every add, and 9 in 10 times a delete of a live one */
+        int *live = malloc(ops * sizeof(*live));
+        long nlive = 0, j;
+
+        if (!live) {
+            fprintf(stderr, "out of memory at size %ld\n", size);
+            exit(1);
+        }
+        for (i = 0; i < ops; i++) {
+            int when = bench_when(dist);
+            int cancel = nlive && bench_rand() % 10;
+
+            j = cancel ? (long)(bench_rand() % nlive) : 0;
+            t = spd_nsnow();
+            live[nlive++] = spd_sched_add_flag(c, when, bench_cb, NULL, 0, 1);
+            if (cancel)
+                spd_sched_del(c, live[j]);
+            samples[i] = lap(t);
+            if (cancel)
+                live[j] = live[--nlive];
+        }
+        report(q, d, size, "churn", ops, mean(samples, ops), samples);
+        for (j = 0; j < nlive; j++)
+            spd_sched_del(c, live[j]);
+        free(live);
+    }
+
+    for (i = 0; i < ops; i++) {
+        int id = ids[bench_rand() % size];
+
+        t = spd_nsnow();
+        spd_sched_when(c, id);
+        samples[i] = lap(t);
+    }
+    report(q, d, size, "when", ops, mean(samples, ops), samples);
+
+    /* a restarted timer, moved in place or deleted and added again */
+    for (i = 0; i < ops; i++) {
+        int when = bench_when(dist);
+
+        t = spd_nsnow();
+        spd_sched_mod(c, opids[i], when);
+        samples[i] = lap(t);
+    }
+    report(q, d, size, "mod", ops, mean(samples, ops), samples);
+
+    for (i = 0; i < ops; i++) {
+        int when = bench_when(dist);
+
+        t = spd_nsnow();
+        spd_sched_del(c, opids[i]);
+        opids[i] = spd_sched_add_flag(c, when, bench_cb, NULL, 0, 1);
+        samples[i] = lap(t);
+    }
+    report(q, d, size, "del+add", ops, mean(samples, ops), samples);
+
+    for (i = 0; i < ops; i++) {
+        t = spd_nsnow();
+        spd_sched_del(c, opids[i]);
+        samples[i] = lap(t);
+    }
+    report(q, d, size, "del", ops, mean(samples, ops), samples);
+
+    /* events due at once, on top of the background */
+    for (i = 0; i < ops; i++)
+        opids[i] = spd_sched_add_flag(c, 1, bench_cb, NULL, 0, 1);
+    if (dist == BENCH_CANCEL) {
+        for (i = 0; i < ops; i++) {
+            if (bench_rand() % 10)
+                spd_sched_del(c, opids[i]);
+        }
+    }
+    usleep(3000);
+    t = spd_nsnow();
+    n = spd_sched_runall(c);
+    report(q, d, size, "runall", n, n ? (double)(spd_nsnow() - t) / n : 0, NULL);
+
+    spd_sche_context_destroy(c);
+    free(samples);
+    free(ids);
+    free(opids);
+}
+
+struct bench_loop {
+    struct scheduler_context *c;
+    int uring;
+    volatile int done;
+    spd_ns_t cpu;       /*!< CPU time of the loop thread */
+};
+
+static void *bench_loop_thread(void *data)
+{
+    struct bench_loop *l = data;
+    struct timespec ts;
+
+    while (!l->done) {
+#ifdef USE_IO_URING
+        if ((l->uring ? spd_sched_uring_wait(l->c) : spd_sched_cond_wait(l->c)) < 0)
+            break;
+#else
+        if (spd_sched_cond_wait(l->c) < 0)
+            break;
+#endif
+        spd_sched_runall(l->c);
+    }
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    l->cpu = (spd_ns_t)ts.tv_sec * SPD_NS_PER_SEC + ts.tv_nsec;
+    return NULL;
+}
+
+/*! \brief
+ * Feed 'rate' timers per second of 1 to 10ms to a loop thread for two
+ * seconds, in batches of one millisecond.
+ */
+static void bench_wait(enum spd_sched_queue type, int uring, long rate)
+{
+    struct bench_loop l = { NULL, uring, 0, 0 };
+    struct spd_sched_req *reqs;
+    struct spd_sched_stats *st;
+    pthread_t thread;
+    spd_ns_t next, end;
+    long per_ms = rate / 1000 > 0 ? rate / 1000 : 1, i, added = 0;
+    const char *op = uring ? "wait_uring" : "wait_cond";
+
+    reqs = calloc(per_ms, sizeof(*reqs));
+    st = malloc(sizeof(*st));
+    l.c = spd_sched_context_create_type(type);
+    if (!reqs || !st || !l.c) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    pthread_create(&thread, NULL, bench_loop_thread, &l);
+
+    next = spd_nsnow();
+    end = next + 2 * SPD_NS_PER_SEC;
+    while ((next += SPD_NS_PER_MS) < end) {
+        for (i = 0; i < per_ms; i++) {
+            reqs[i].when = 1 + bench_rand() % 10;
+            reqs[i].callback = bench_cb;
+            reqs[i].slack = slack;
+        }
+        added += spd_sched_add_batch(l.c, reqs, per_ms, NULL);
+        while (spd_nsnow() < next)
+            ;
+    }
+    /* let the last timers fire, then wake the loop so it sees 'done' */
+    usleep(20000 + slack * 1000);
+    l.done = 1;
+    spd_sched_add(l.c, 1, bench_cb, NULL);
+    pthread_join(thread, NULL);
+
+    spd_sched_get_stats(l.c, st);
+    fprintf(out, "%s\n  {\"queue\": \"%s\", \"op\": \"%s\", \"rate\": %ld, \"slack\": %d, \"added\": %ld, "
+        "\"fired\": %llu, \"wakeups\": %llu, \"loop_cpu_ms\": %.1f, "
+        "\"late_p50_us\": %llu, \"late_p99_us\": %llu, \"late_max_us\": %llu}",
+        nresults++ ? "," : "", queue_names[type], op, rate, slack, added, (unsigned long long)st->fires,
+        (unsigned long long)st->wakeups, l.cpu / 1e6, (unsigned long long)spd_sched_hist_percentile(&st->lateness, 50),
+        (unsigned long long)spd_sched_hist_percentile(&st->lateness, 99),
+        (unsigned long long)st->lateness.max);
+    fprintf(stderr, "%-6s %-10s %ld/s slack %dms fired %llu, %llu wakeups, loop cpu %.1f ms, late p99 %llu us\n",
+        queue_names[type], op, rate, slack, (unsigned long long)st->fires, (unsigned long long)st->wakeups, l.cpu / 1e6,
+        (unsigned long long)spd_sched_hist_percentile(&st->lateness, 99));
+
+    spd_sche_context_destroy(l.c);
+    free(reqs);
+    free(st);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-q heap|wheel] [-d uniform|bimodal|cancel] [-s size,...] "
+        "[-k ops] [-w rate [-S slack]] [-o file]\n", prog);
+    exit(2);
+}
+
+static int lookup(const char *name, const char **names, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (!strcmp(name, names[i]))
+            return i;
+    }
+    return -1;
+}
+
+int main(int argc, char **argv)
+{
+    long sizes[BENCH_MAX_SIZES] = { 1000, 10000, 100000, 1000000, 10000000 };
+    int nsizes = 5, qfirst = 0, qlast = 1, dfirst = 0, dlast = 2, opt, q, d, s;
+    long ops = 100000, rate = 0;
+    char *p;
+    spd_ns_t t;
+
+    out = stdout;
+    while ((opt = getopt(argc, argv, "q:d:s:k:w:S:o:")) != -1) {
+        switch (opt) {
+        case 'q':
+            if ((qfirst = qlast = lookup(optarg, queue_names, 2)) < 0)
+                usage(argv[0]);
+            break;
+        case 'd':
+            if ((dfirst = dlast = lookup(optarg, dist_names, 3)) < 0)
+                usage(argv[0]);
+            break;
+        case 's':
+            for (nsizes = 0, p = optarg; *p && nsizes < BENCH_MAX_SIZES; p += *p == ',') {
+                if ((sizes[nsizes++] = strtol(p, &p, 10)) <= 0)
+                    usage(argv[0]);
+            }
+            break;
+        case 'k':
+            if ((ops = atol(optarg)) <= 0)
+                usage(argv[0]);
+            break;
+        case 'w':
+            if ((rate = atol(optarg)) <= 0)
+                usage(argv[0]);
+            break;
+        case 'S':
+            if ((slack = atoi(optarg)) < 0)
+                usage(argv[0]);
+            break;
+        case 'o':
+            if (!(out = fopen(optarg, "w"))) {
+                perror(optarg);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    /* what one clock read costs: a sample spans its op and the second of its two reads */
+    t = spd_nsnow();
+    for (s = 0; s < 100000; s++)
+        spd_nsnow();
+    clock_cost = (spd_nsnow() - t) / 100000;
+
+    fprintf(out, "[");
+    for (q = qfirst; q <= qlast; q++) {
+        if (rate) {
+            bench_wait(q, 0, rate);
+#ifdef USE_IO_URING
+            bench_wait(q, 1, rate);
+#endif
+            continue;
+        }
+        for (d = dfirst; d <= dlast; d++) {
+            for (s = 0; s < nsizes; s++)
+                bench_size(q, d, sizes[s], ops < sizes[s] ? ops : sizes[s]);
+        }
+    }
+    fprintf(out, "\n]\n");
+    if (out != stdout)
+        fclose(out);
+    return 0;
+}
@@ -0,0 +1,304 @@
+/*
+ * Contention load generator for one scheduler context.
+ *
+ * Build:  gcc -O2 -DSPD_SCHED_LOCK_STATS -I. loadgen_scheduler.c scheduler.c -lpthread -o loadgen_scheduler
+ * Run:    ./loadgen_scheduler [-p 1,2,4,...] [-D dispatchers] [-r rate] [-c cancel]
+ *                             [-d short|uniform|bimodal] [-T secs] [-q heap|wheel] [-l] [-o file]
+ *
+ * Models session-timer traffic: P producer threads add timers to one
+ * context and cancel a share of them a while later, as a refreshed or
+ * answered session does, while D dispatcher threads loop on
+ * spd_sched_cond_wait()/spd_sched_runall(). Every producer count of -p
+ * is one step on a fresh context. A step reports the operation rate,
+ * the wait and hold times of the context lock (when built with
+ * SPD_SCHED_LOCK_STATS) and the firing lateness, as one JSON record on
+ * stdout (or -o), so steps make a scaling curve.
+ *
+ * -r is the total add rate in timers per second, 0 adds as fast as the
+ * producers can. -c is the share of timers cancelled before they fire.
+ * -l adds through the lock-free inbox.
+ */
+#include "scheduler.h"
+#include "times.h"
+
+#define LOAD_MAX_STEPS  16
+#define LOAD_PENDING    256    /*!< Timers a producer keeps before cancelling, power of two */
+
+enum load_dist {
+    LOAD_SHORT,        /*!< 1 to 50ms, most fire within a step */
+    LOAD_UNIFORM,      /*!< 1s to 60s */
+    LOAD_BIMODAL,      /*!< 80% keepalives around 30s, 20% retransmits of 0.5s to 16s */
+};
+
+static const char *dist_names[] = { "short", "uniform", "bimodal" };
+static const char *queue_names[] = { "heap", "wheel" };
+
+static struct {
+    struct scheduler_context *c;
+    enum load_dist dist;
+    double cancel;
+    spd_ns_t interval;        /*!< Between two adds of one producer, 0 for no pacing */
+    spd_ns_t end;
+    int dispatchers;          /*!< Dispatcher threads still running */
+    int done;
+} load;
+
+struct load_producer {
+    pthread_t thread;
+    uint64_t rng;
+    uint64_t adds;
+    uint64_t dels;
+    uint64_t failed;
+};
+
+static uint64_t load_rand(uint64_t *rng)
+{
+    *rng ^= *rng << 13;
+    *rng ^= *rng >> 7;
+    *rng ^= *rng << 17;
+    return *rng;
+}
+
+static int load_when(uint64_t *rng)
+{
+    switch (load.dist) {
+    case LOAD_SHORT:
+        return 1 + load_rand(rng) % 50;
+    case LOAD_BIMODAL:
+        if (load_rand(rng) % 5)
+            return 25000 + load_rand(rng) % 10000;
+        return 500 << (load_rand(rng) % 6);
+    default:
+        return 1000 + load_rand(rng) % 59000;
+    }
+}
+
+static int load_cb(void *data)
+{
+    (void)data;
+    return 0;
+}
+
+static void *load_producer_thread(void *data)
+{
+    struct load_producer *p = data;
+    int pending[LOAD_PENDING];
+    unsigned int head = 0, tail = 0;
+    spd_ns_t next = spd_nsnow();
+    int id;
+
+    while (spd_nsnow() < load.end) {
+        if (load.interval) {
+            next += load.interval;
+            while (spd_nsnow() < next)
+                ;
+        }
+        if ((id = spd_sched_add_flag(load.c, load_when(&p->rng), load_cb, NULL, 0, 1)) < 0) {
+            p->failed++;
+            continue;
+        }
+        p->adds++;
+        if (load_rand(&p->rng) % 1000 >= load.cancel * 1000)
+            continue;
+        /* cancel LOAD_PENDING cancellable timers later */
+        if (head - tail == LOAD_PENDING) {
+            if (!spd_sched_del(load.c, pending[tail & (LOAD_PENDING - 1)]))
+                p->dels++;
+            tail++;
+        }
+        pending[head++ & (LOAD_PENDING - 1)] = id;
+    }
+    while (tail != head) {
+        if (!spd_sched_del(load.c, pending[tail++ & (LOAD_PENDING - 1)]))
+            p->dels++;
+    }
+    return NULL;
+}
+
+static void *load_dispatcher_thread(void *data)
+{
+    (void)data;
+    while (!__atomic_load_n(&load.done, __ATOMIC_ACQUIRE)) {
+        if (spd_sched_cond_wait(load.c) < 0)
+            break;
+        spd_sched_runall(load.c);
+    }
+    __atomic_sub_fetch(&load.dispatchers, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static double hist_frac0(const struct spd_sched_hist *h)
+{
+    uint64_t total = 0;
+    int i;
+
+    for (i = 0; i < SPD_SCHED_HIST_BUCKETS; i++)
+        total += h->count[i];
+    return total ? (double)h->count[0] / total : 1.0;
+}
+
+static void load_step(FILE *out, int first, enum spd_sched_queue type, int lockfree, int nprod,
+    int ndisp, long rate, int secs)
+{
+    struct load_producer *prod = calloc(nprod, sizeof(*prod));
+    pthread_t *disp = calloc(ndisp, sizeof(*disp));
+    struct spd_sched_stats *st = malloc(sizeof(*st));
+    uint64_t adds = 0, dels = 0, failed = 0;
+    spd_ns_t start, elapsed;
+    int i;
+
+    if (!prod || !disp || !st || !(load.c = spd_sched_context_create_type(type))) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    spd_sched_set_lockfree(load.c, lockfree);
+    load.interval = rate > 0 ? SPD_NS_PER_SEC * nprod / rate : 0;
+    load.done = 0;
+    load.dispatchers = ndisp;
+    for (i = 0; i < ndisp; i++)
+        pthread_create(&disp[i], NULL, load_dispatcher_thread, NULL);
+
+    start = spd_nsnow();
+    load.end = start + secs * SPD_NS_PER_SEC;
+    for (i = 0; i < nprod; i++) {
+        prod[i].rng = 88172645463325252ULL + i * 2654435761ULL;
+        pthread_create(&prod[i].thread, NULL, load_producer_thread, &prod[i]);
+    }
+    for (i = 0; i < nprod; i++) {
+        pthread_join(prod[i].thread, NULL);
+        adds += prod[i].adds;
+        dels += prod[i].dels;
+        failed += prod[i].failed;
+    }
+    elapsed = spd_nsnow() - start;
+
+    /* let the short timers fire, then take the dispatchers down */
+    usleep(100000);
+    __atomic_store_n(&load.done, 1, __ATOMIC_RELEASE);
+    while (__atomic_load_n(&load.dispatchers, __ATOMIC_ACQUIRE)) {
+        /* every add wakes one sleeping dispatcher */
+        spd_sched_add(load.c, 1, load_cb, NULL);
+        usleep(1000);
+    }
+    for (i = 0; i < ndisp; i++)
+        pthread_join(disp[i], NULL);
+
+    spd_sched_get_stats(load.c, st);
+    fprintf(out, "%s\n  {\"queue\": \"%s\", \"lockfree\": %d, \"dist\": \"%s\", \"producers\": %d, "
+        "\"dispatchers\": %d, \"rate\": %ld, \"cancel\": %.2f, \"secs\": %.2f, "
+        "\"adds\": %llu, \"dels\": %llu, \"failed\": %llu, \"fires\": %llu, \"ops_per_sec\": %.0f, "
+        "\"lock_contended\": %.4f, \"lock_wait_p50_ns\": %llu, \"lock_wait_p99_ns\": %llu, \"lock_wait_max_ns\": %llu, "
+        "\"lock_hold_p50_ns\": %llu, \"lock_hold_p99_ns\": %llu, \"lock_hold_max_ns\": %llu, "
+        "\"late_p50_us\": %llu, \"late_p99_us\": %llu, \"late_p999_us\": %llu, \"late_max_us\": %llu}",
+        first ? "" : ",", queue_names[type], lockfree, dist_names[load.dist], nprod, ndisp, rate, load.cancel,
+        elapsed / 1e9, (unsigned long long)adds, (unsigned long long)dels, (unsigned long long)failed,
+        (unsigned long long)st->fires, (adds + dels) * 1e9 / elapsed,
+        1.0 - hist_frac0(&st->lockwait),
+        (unsigned long long)spd_sched_hist_percentile(&st->lockwait, 50),
+        (unsigned long long)spd_sched_hist_percentile(&st->lockwait, 99),
+        (unsigned long long)st->lockwait.max,
+        (unsigned long long)spd_sched_hist_percentile(&st->lockhold, 50),
+        (unsigned long long)spd_sched_hist_percentile(&st->lockhold, 99),
+        (unsigned long long)st->lockhold.max,
+        (unsigned long long)spd_sched_hist_percentile(&st->lateness, 50),
+        (unsigned long long)spd_sched_hist_percentile(&st->lateness, 99),
+        (unsigned long long)spd_sched_hist_percentile(&st->lateness, 99.9),
+        (unsigned long long)st->lateness.max);
+    fflush(out);
+    fprintf(stderr, "%2d producers: %10.0f ops/s, lock wait p99 %llu ns hold p99 %llu ns, late p99 %llu us max %llu us\n",
+        nprod, (adds + dels) * 1e9 / elapsed,
+        (unsigned long long)spd_sched_hist_percentile(&st->lockwait, 99),
+        (unsigned long long)spd_sched_hist_percentile(&st->lockhold, 99),
+        (unsigned long long)spd_sched_hist_percentile(&st->lateness, 99),
+        (unsigned long long)st->lateness.max);
+
+    spd_sche_context_destroy(load.c);
+    free(prod);
+    free(disp);
+    free(st);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-p n,...] [-D dispatchers] [-r rate] [-c cancel] "
+        "[-d short|uniform|bimodal] [-T secs] [-q heap|wheel] [-l] [-o file]\n", prog);
+    exit(2);
+}
+
+static int lookup(const char *name, const char **names, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (!strcmp(name, names[i]))
+            return i;
+    }
+    return -1;
+}
+
+int main(int argc, char **argv)
+{
+    int steps[LOAD_MAX_STEPS] = { 1, 2, 4, 8, 16, 32, 64 };
+    int nsteps = 7, ndisp = 1, secs = 2, lockfree = 0, type = SPD_SCHED_QUEUE_HEAP, opt, i;
+    long rate = 0;
+    FILE *out = stdout;
+    char *p;
+
+    load.cancel = 0.8;
+    load.dist = LOAD_SHORT;
+    while ((opt = getopt(argc, argv, "p:D:r:c:d:T:q:lo:")) != -1) {
+        switch (opt) {
+        case 'p':
+            for (nsteps = 0, p = optarg; *p && nsteps < LOAD_MAX_STEPS; p += *p == ',') {
+                if ((steps[nsteps++] = strtol(p, &p, 10)) <= 0)
+                    usage(argv[0]);
+            }
+            break;
+        case 'D':
+            if ((ndisp = atoi(optarg)) <= 0)
+                usage(argv[0]);
+            break;
+        case 'r':
+            if ((rate = atol(optarg)) < 0)
+                usage(argv[0]);
+            break;
+        case 'c':
+            load.cancel = atof(optarg);
+            if (load.cancel < 0 || load.cancel > 1)
+                usage(argv[0]);
+            break;
+        case 'd':
+            if ((i = lookup(optarg, dist_names, 3)) < 0)
+                usage(argv[0]);
+            load.dist = i;
+            break;
+        case 'T':
+            if ((secs = atoi(optarg)) <= 0)
+                usage(argv[0]);
+            break;
+        case 'q':
+            if ((type = lookup(optarg, queue_names, 2)) < 0)
+                usage(argv[0]);
+            break;
+        case 'l':
+            lockfree = 1;
+            break;
+        case 'o':
+            if (!(out = fopen(optarg, "w"))) {
+                perror(optarg);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    fprintf(out, "[");
+    for (i = 0; i < nsteps; i++)
+        load_step(out, !i, type, lockfree, steps[i], ndisp, rate, secs);
+    fprintf(out, "\n]\n");
+    if (out != stdout)
+        fclose(out);
+    return 0;
+}
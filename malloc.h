@@ -2,53 +2,51 @@
 #define MALLOC_H
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 
-static int malloc_cnt;
-static int free_cnt;
+#ifdef MALLOC_DEBUG
+/*! \brief Allocation counters of the whole process
+ * \note Every thread counts its own allocations, the totals are added
+ * up when they are asked for. Sizes are the usable sizes reported by
+ * the allocator.
+ */
+struct spd_mem_stats {
+    uint64_t allocs;     /*!< Blocks allocated */
+    uint64_t frees;      /*!< Blocks freed */
+    int64_t bytes;       /*!< Bytes in use */
+    int64_t peak;        /*!< Most bytes in use at once, to within 64 KiB per thread */
+};
 
-static void log_memory( const char *file, const char* func, int line, const char* format, ... );
+/*! \brief Called for every allocation site seen by the sampler
+ * \param allocs estimated allocations made at file:line
+ * \param bytes estimated bytes allocated at file:line
+ */
+typedef void (*spd_mem_site_cb)(const char *file, int line, uint64_t allocs, uint64_t bytes, void *arg);
 
-#define LOG_MALLOC(size) \
-    ({ \
-     void* mm = malloc(size);\
-     int cnt; \
-    if (mm) { \
-        cnt = __sync_add_and_fetch(&malloc_cnt, 1); \
-    } \
-    log_memory(__FILE__, __PRETTY_FUNCTION__, __LINE__, "LOG_MALLOC %p(size:%d), malloc count:%d", mm, (size), cnt); mm; \
-    })
+void *spd_mem_malloc(size_t size, const char *file, int line);
+void *spd_mem_calloc(size_t n, size_t unit, const char *file, int line);
+void *spd_mem_realloc(void *ptr, size_t size, const char *file, int line);
+void spd_mem_free(void *ptr);
 
-#define LOG_CALLOC(n, unit) \
-    ({ \
-     int size = (n) * (unit); \
-     void* mm = malloc(size);\
-     int cnt; \
-    if (mm) { \
-       cnt = __sync_add_and_fetch(&malloc_cnt, 1); \
-       memset(mm, 0, size); \
-    } \
-    log_memory(__FILE__, __PRETTY_FUNCTION__, __LINE__, "LOG_MALLOC %p(size:%d), malloc count:%d", mm, size, cnt); mm; \
-    })
+/*! \brief Adds up the counters of all threads */
+void spd_mem_get_stats(struct spd_mem_stats *st);
 
-#define LOG_FREE(ptr) \
-    ({ \
-     void* mm = (ptr); \
-     int cnt; \
-    if (mm) { \
-        cnt = __sync_add_and_fetch(&free_cnt, 1); \
-    } \
-    log_memory(__FILE__, __PRETTY_FUNCTION__, __LINE__, "LOG_FREE %p, free count:%d", mm, cnt); free(ptr); \
-    })
+/*! \brief Records the call site of one allocation out of every
+ * 'every', 0 turns the sampler off (the default).
+ */
+void spd_mem_set_sample(unsigned int every);
 
-static void log_memory( const char *file, const char* func, int line, const char* format, ... )
-{    
-    va_list args;
-    char buf[256] = {0};
+/*! \brief Calls cb for every sampled call site */
+void spd_mem_walk_sites(spd_mem_site_cb cb, void *arg);
 
-    va_start( args, format );
-    vsnprintf( buf, 256, format, args );
-    fprintf( stdout, "[%s:%s:%d] %s\n", file, func, line, buf );
-    va_end( args );
-    fflush( stdout );
-}
+#define LOG_MALLOC(size)        spd_mem_malloc((size), __FILE__, __LINE__)
+#define LOG_CALLOC(n, unit)     spd_mem_calloc((n), (unit), __FILE__, __LINE__)
+#define LOG_REALLOC(ptr, size)  spd_mem_realloc((ptr), (size), __FILE__, __LINE__)
+#define LOG_FREE(ptr)           spd_mem_free(ptr)
+#else
+#define LOG_MALLOC(size)        malloc(size)
+#define LOG_CALLOC(n, unit)     calloc((n), (unit))
+#define LOG_REALLOC(ptr, size)  realloc((ptr), (size))
+#define LOG_FREE(ptr)           free(ptr)
+#endif
 #endif
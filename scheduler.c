@@ -17,13 +17,19 @@
 #include "linkedlist.h"
 #include "times.h"
 
-#ifdef DEBUG_SCHEDULER
-#define spd_log(priority, fmt, ...) \
-    printf("[file: %s line:%d func:%s]" fmt, __FILE__, __LINE__, __PRETTY_FUNCTION__, ##__VA_ARGS__);
-#else
-#define spd_log(priority, fmt, ...) \
-    syslog((priority),"[file: %s line:%d func:%s]" fmt, __FILE__, __LINE__, __PRETTY_FUNCTION__, ##__VA_ARGS__);
+#include <limits.h>
+#include <stddef.h>
+#include <sched.h>
+#include <sys/timerfd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <errno.h>
+#ifdef USE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
 #endif
+
        
 
 #ifdef MALLOC_DEBUG
@@ -35,433 +41,3249 @@
         free(buf);\
         buf = NULL;}
 #endif
-       
-#define ONE_MILLION    1000000
-
-#define DEBUG_M(a) {\
-    (a);  \
-}
 
-#ifdef DEBUG_SCHEDULER
-    #define DEBUG(a) do { \
-    if(option_debug) \
-        DEBUG_M(a)  \
-        } while(0)
-#else 
-#define DEBUG(a)
+#ifdef MALLOC_DEBUG
+#define SCHED_CALLOC(n, size)     LOG_CALLOC(n, size)
+#define SCHED_REALLOC(ptr, size)  LOG_REALLOC(ptr, size)
+#else
+#define SCHED_CALLOC(n, size)     calloc(n, size)
+#define SCHED_REALLOC(ptr, size)  realloc(ptr, size)
 #endif
 
-struct scheduler {
-    int flag;              /*!< Use return value from callback to reschedule */
-    int reschedule;        /*!< When to reschedule (only if flag is false). */
-    int id;                /*!< ID number of event */
-    int retry_times;       /*!< Total retry times, negative value will always retry. */
-    struct timeval when;   /*!< Absolute time event should take place */
-    spd_scheduler_cb callback;
-    void *data;
-    SPD_LIST_ENTRY(scheduler)list;
-};
-
-struct scheduler_context {
-    pthread_mutex_t lock;
-    unsigned int processedcnt;                         /*!< Number of events processed */
-    unsigned int schedsnt;                             /*!< Number of outstanding schedule events */
-    SPD_LIST_HEAD_NOLOCK(, scheduler)schedulerq;       /*!< Schedule entry and main queue */
-#ifdef SPD_SCHED_MA_CACHE
-    SPD_LIST_HEAD_NOLOCK(, scheduler)schedulerc;
-    unsigned int schedccnt;
-#endif
-#ifdef USE_COND_WAIT
-    pthread_cond_t cond;
+/*! \brief Least important syslog priority compiled in
+ * \note Messages above it are removed by the compiler, the others
+ * cost one branch unless enabled with spd_sched_set_log_level().
+ */
+#ifndef SPD_SCHED_LOG_MAX
+#define SPD_SCHED_LOG_MAX       LOG_DEBUG
 #endif
-};
 
-struct timeval spd_tvadd(struct timeval a, struct timeval b);
-struct timeval spd_tvsub(struct timeval a, struct timeval b);
-/*
- * put timeval in a valid range. usec is 0..999999
- * negative values are not allowed and truncated.
+/*! \brief Asynchronous log
+ * \note Every thread formats its messages into a ring of its own and a
+ * background thread writes them out. The writer wakes it when its ring
+ * fills up to SPD_SCHED_LOG_WAKE or the message is a warning or worse,
+ * otherwise it flushes every SPD_SCHED_LOG_IDLE_MS, so an idle process
+ * is not woken and logging rarely makes a system call in the caller.
+ * Messages written while the ring is full are dropped and counted.
+ * Rings are never freed, a thread that exits hands its ring to the
+ * next new thread; what its later destructors log is written out at
+ * once.
  */
-static struct timeval tvfix(struct timeval a);
+#define SPD_SCHED_LOG_RING      128    /*!< Messages per thread, power of two */
+#define SPD_SCHED_LOG_MSG       256
+#define SPD_SCHED_LOG_WAKE      (SPD_SCHED_LOG_RING / 2)
+#define SPD_SCHED_LOG_IDLE_MS   1000
 
-struct scheduler_context *spd_sched_context_create(void)
-{
-    struct scheduler_context *sc;
+struct sched_log_rec {
+    int priority;
+    char msg[SPD_SCHED_LOG_MSG];
+};
 
-#ifdef MALLOC_DEBUG
-    if(!(sc = LOG_CALLOC(1, sizeof(*sc)))) {
+struct sched_log_ring {
+    struct sched_log_ring *next;
+    int owned;                 /*!< A thread writes to this ring */
+    unsigned int head;         /*!< Next message to write, only moved by the owner */
+    unsigned int tail;         /*!< Next message to write out, only moved by the flusher */
+    struct sched_log_rec rec[SPD_SCHED_LOG_RING];
+};
+
+static struct {
+    pthread_mutex_t lock;      /*!< Protects the ring list and serializes flushing */
+    struct sched_log_ring *rings;
+    int level;                 /*!< Least important priority logged */
+    unsigned int dropped;      /*!< Messages lost to full rings */
+    pthread_once_t once;
+    pthread_key_t key;         /*!< Releases the ring of an exiting thread */
+    pthread_mutex_t wakelock;  /*!< Protects wake, never held while writing out */
+    pthread_cond_t wakecond;   /*!< Signalled when wake is set, on CLOCK_MONOTONIC */
+    int wake;                  /*!< A ring wants to be written out */
+} sched_log = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wakelock = PTHREAD_MUTEX_INITIALIZER,
+#ifdef DEBUG_SCHEDULER
+    .level = LOG_DEBUG,
 #else
-    if(!(sc = calloc(1, sizeof(*sc)))) {
+    .level = LOG_NOTICE,
 #endif
-        return NULL;
-    }
+    .once = PTHREAD_ONCE_INIT,
+};
 
-    pthread_mutex_init(&sc->lock, NULL /*&attr*/);
-#ifdef USE_COND_WAIT
-    pthread_cond_init(&sc->cond, NULL);
-#endif
-    
-    sc->processedcnt = 1;
-    sc->schedsnt = 0;
-    SPD_LIST_HEAD_INIT_NOLOCK(&sc->schedulerq);
-#ifdef SPD_SCHED_MA_CACHE
-    SPD_LIST_HEAD_INIT_NOLOCK(&sc->schedulerc);
-    sc->schedccnt = 0;
-#endif
-    return sc;
-}
+static __thread struct sched_log_ring *sched_log_self;
+static __thread int sched_log_gone;   /*!< The ring was released, the thread is exiting */
 
-void spd_sche_context_destroy(struct scheduler_context *sc)
+static void sched_log_write(int priority, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static inline int sched_log_enabled(int priority)
 {
-    struct scheduler *s;
+    return __builtin_expect(priority <= __atomic_load_n(&sched_log.level, __ATOMIC_RELAXED), 0);
+}
 
-    pthread_mutex_lock(&sc->lock);    
-#ifdef USE_COND_WAIT
-    pthread_cond_destroy(&sc->cond);
-#endif
+#define spd_log(priority, fmt, ...) do { \
+    if ((priority) <= SPD_SCHED_LOG_MAX && sched_log_enabled(priority)) \
+        sched_log_write((priority), "[file: %s line:%d func:%s]" fmt, __FILE__, __LINE__, __PRETTY_FUNCTION__, ##__VA_ARGS__); \
+    } while (0)
 
-#ifdef SPD_SCHED_MA_CACHE
-    while((s = SPD_LIST_REMOVE_HEAD(&sc->schedulerc, list)))
-        SAFE_FREE(s);
+static void sched_log_emit(int priority, const char *msg)
+{
+#ifdef DEBUG_SCHEDULER
+    fputs(msg, stdout);
+#else
+    syslog(priority, "%s", msg);
 #endif
+}
 
-    while((s = SPD_LIST_REMOVE_HEAD(&sc->schedulerq, list)))
-        SAFE_FREE(s);
-
-    pthread_mutex_unlock(&sc->lock);
+/*! \brief
+ * Write out the messages of all threads.
+ */
+static void sched_log_drain(void)
+{
+    struct sched_log_ring *r;
+    struct sched_log_rec *rec;
+    unsigned int tail, head, dropped;
 
-    pthread_mutex_destroy(&sc->lock);
+    pthread_mutex_lock(&sched_log.lock);
+    for (r = sched_log.rings; r; r = r->next) {
+        tail = r->tail;
+        head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        while (tail != head) {
+            rec = &r->rec[tail & (SPD_SCHED_LOG_RING - 1)];
+            sched_log_emit(rec->priority, rec->msg);
+            __atomic_store_n(&r->tail, ++tail, __ATOMIC_RELEASE);
+        }
+    }
+    if ((dropped = __atomic_exchange_n(&sched_log.dropped, 0, __ATOMIC_RELAXED))) {
+        char msg[64];
 
-    SAFE_FREE(sc);
+        snprintf(msg, sizeof(msg), "scheduler log dropped %u messages\n", dropped);
+        sched_log_emit(LOG_WARNING, msg);
+    }
+    pthread_mutex_unlock(&sched_log.lock);
 }
 
-static struct scheduler *sched_alloc(struct scheduler_context *con)
+static void *sched_log_thread(void *data)
 {
-    struct scheduler *tmp;
-
-#ifdef SPD_SCHED_MA_CACHE
-    if((tmp = SPD_LIST_REMOVE_HEAD(&con->schedulerc, list))) {
-            con->schedccnt--;
-                return tmp;
-        }
-#endif 
-#ifdef MALLOC_DEBUG
-    if(!(tmp = LOG_CALLOC(1, sizeof(*tmp))))
-#else
-    if(!(tmp = calloc(1, sizeof(*tmp))))
-#endif
-        return NULL;
+    struct timespec ts;
 
-    return tmp;
+    (void)data;
+    for (;;) {
+        ts = spd_ns2ts(spd_nsnow() + SPD_SCHED_LOG_IDLE_MS * SPD_NS_PER_MS);
+        pthread_mutex_lock(&sched_log.wakelock);
+        while (!sched_log.wake && pthread_cond_timedwait(&sched_log.wakecond, &sched_log.wakelock, &ts) != ETIMEDOUT)
+            ;
+        __atomic_store_n(&sched_log.wake, 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&sched_log.wakelock);
+        sched_log_drain();
+    }
+    return NULL;
 }
 
-static void scheduler_release(struct scheduler_context *con, struct scheduler *sc)
+/*! \brief
+ * Wake the flusher unless it has been woken already.
+ */
+static void sched_log_kick(void)
 {
-        if (!sc) {
-                return;
-        }        
-        SAFE_FREE(sc->data);
-#ifdef SPD_SCHED_MA_CACHE
-        if(con->schedccnt < SPD_SCHED_MA_CACHE) {
-            SPD_LIST_INSERT_HEAD(&con->schedulerc, sc, list);
-            con->schedccnt++;
-                    return;
-        }
-#endif
-        SAFE_FREE(sc);
+    if (__atomic_load_n(&sched_log.wake, __ATOMIC_RELAXED))
+        return;
+    pthread_mutex_lock(&sched_log.wakelock);
+    __atomic_store_n(&sched_log.wake, 1, __ATOMIC_RELAXED);
+    pthread_cond_signal(&sched_log.wakecond);
+    pthread_mutex_unlock(&sched_log.wakelock);
 }
 
-/* To support new scheduler inform when add a new scheduler. */
-#ifdef USE_COND_WAIT
-/* To support new scheduler inform when add a new scheduler.*/
-int spd_sched_cond_wait(struct scheduler_context * c)
+static void sched_log_release(void *arg)
 {
-    int ms;
-    struct timespec wait;
-    pthread_mutex_lock(&c->lock);
-    while (SPD_LIST_EMPTY(&c->schedulerq))
-    {
-        pthread_cond_wait(&c->cond, &c->lock);
-    }
+    struct sched_log_ring *r = arg;
 
-    ms = spd_tvdiff_ms(SPD_LIST_FIRST(&c->schedulerq)->when, spd_tvnow());
-    if (ms < 0)
-    {
-        ms = 0;
-    }
-    else if(ms > 0)
-    {
-        if (ms < 1000)
-        {
-            /* if wait time is less than 1 sec, just do a sleep*/
-            usleep((ms+1)*1000);
-        }
-        else
-        {
-            /* if wait time is more than 1 sec, use pthread_cond_timedwait so we can waken up in time to process new scheduler 
-                        because of  a pthread_cond_signal call. */
-            wait.tv_sec = (ms+1)/1000;
-            wait.tv_nsec = (ms+1) % 1000 * 1000000;
-            pthread_cond_timedwait(&c->cond, &c->lock, &wait);
-        }
-        ms = 0;
-    }
-    pthread_mutex_unlock(&c->lock);
+    /* a ring has one writer, later destructors of this thread log straight out */
+    sched_log_self = NULL;
+    sched_log_gone = 1;
+    __atomic_store_n(&r->owned, 0, __ATOMIC_RELEASE);
+}
 
-    return ms;
+static void sched_log_start(void)
+{
+    pthread_condattr_t cattr;
+    pthread_t thread;
+
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&sched_log.wakecond, &cattr);
+    pthread_condattr_destroy(&cattr);
+    pthread_key_create(&sched_log.key, sched_log_release);
+    if (!pthread_create(&thread, NULL, sched_log_thread, NULL))
+        pthread_detach(thread);
 }
 
-#else
 /*! \brief
- * Return the number of milliseconds 
- * until the next scheduled event
+ * The ring of the calling thread, NULL if it can not have one.
  */
-int spd_sched_wait(struct scheduler_context * c)
+static struct sched_log_ring *sched_log_ring(void)
 {
-    int ms;
-    //DEBUG(spd_log(LOG_DEBUG, "ast_sched_wait()\n"));
-    //spd_log(LOG_DEBUG, "ast_sched_wait()\n");
-    pthread_mutex_lock(&c->lock);
-    if(SPD_LIST_EMPTY(&c->schedulerq)){
-        ms = -1;
-    } else {
-        ms = spd_tvdiff_ms(SPD_LIST_FIRST(&c->schedulerq)->when, spd_tvnow());
-        if(ms < 0)
-            ms = 0;
-    }
-    pthread_mutex_unlock(&c->lock);
+    struct sched_log_ring *r;
 
-    return ms;
+    if (sched_log_self || sched_log_gone)
+        return sched_log_self;
+    pthread_once(&sched_log.once, sched_log_start);
+    pthread_mutex_lock(&sched_log.lock);
+    for (r = sched_log.rings; r && __atomic_load_n(&r->owned, __ATOMIC_ACQUIRE); r = r->next)
+        ;
+    if (!r && (r = SCHED_CALLOC(1, sizeof(*r)))) {
+        r->next = sched_log.rings;
+        sched_log.rings = r;
+    }
+    if (r) {
+        r->owned = 1;
+        pthread_setspecific(sched_log.key, r);
+    }
+    pthread_mutex_unlock(&sched_log.lock);
+    return sched_log_self = r;
 }
-#endif
 
-/*! \brief
- * Take a sched structure and put it in the
- * queue, such that the soonest event is
- * first in the list.
- */
-static void add_scheduler(struct scheduler_context *c, struct scheduler *s)
+static void sched_log_write(int priority, const char *fmt, ...)
 {
-    struct scheduler *cur = NULL;
+    struct sched_log_ring *r = sched_log_ring();
+    struct sched_log_rec *rec;
+    unsigned int head, fill;
+    va_list ap;
 
-    if (!s) {
+    if (!r && sched_log_gone) {
+        char msg[SPD_SCHED_LOG_MSG];
+
+        va_start(ap, fmt);
+        vsnprintf(msg, sizeof(msg), fmt, ap);
+        va_end(ap);
+        sched_log_emit(priority, msg);
         return;
     }
-
-    SPD_LIST_TRAVERSE_SAFE_BEGIN(&c->schedulerq, cur, list) {
-        if(spd_tvcmp(s->when, cur->when)  == -1){
-            SPD_LIST_INSERT_BEFORE_CURRENT(s, list);
-            break;
-        }
+    if (!r) {
+        __atomic_fetch_add(&sched_log.dropped, 1, __ATOMIC_RELAXED);
+        return;
     }
-    SPD_LIST_TRAVERSE_SAFE_END
-
-    if(!cur) {
-        SPD_LIST_INSERT_TAIL(&c->schedulerq, s, list);
+    head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    fill = head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if (fill == SPD_SCHED_LOG_RING) {
+        __atomic_fetch_add(&sched_log.dropped, 1, __ATOMIC_RELAXED);
+        sched_log_kick();
+        return;
     }
+    rec = &r->rec[head & (SPD_SCHED_LOG_RING - 1)];
+    rec->priority = priority;
+    va_start(ap, fmt);
+    vsnprintf(rec->msg, sizeof(rec->msg), fmt, ap);
+    va_end(ap);
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    if (fill + 1 >= SPD_SCHED_LOG_WAKE || priority <= LOG_WARNING)
+        sched_log_kick();
+}
 
-    c->schedsnt++;    
+int spd_sched_set_log_level(int level)
+{
+    return __atomic_exchange_n(&sched_log.level, level, __ATOMIC_RELAXED);
 }
 
-/*! \brief
- * computes the next time to schedule, 'tv' is the base time (usually is the time the last 
- * event happended.) 'when' is the offset in milliseconds. if tv is 0, use the current 
- * time as default.
- *
- * sched_settime always return 0 now.
- */
-static int sched_settime(struct timeval *tv, int when)
+void spd_sched_log_flush(void)
 {
-    struct timeval now = spd_tvnow();
-    if(spd_tvzero(*tv))
-        *tv = now;
-    *tv = spd_tvadd(*tv, spd_samp2tv(when, 1000));
-    if(spd_tvcmp(*tv, now) < 0) {
-        *tv = now;
-    }
-    return 0;
+    sched_log_drain();
 }
 
-/*! \brief
- * Schedule callback(data) to happen when ms into the future
+#ifdef MALLOC_DEBUG
+/* not from <malloc.h>, that name is taken by ours */
+extern size_t malloc_usable_size(void *ptr);
+
+/*! \brief Allocation accounting of LOG_MALLOC() and friends
+ * \note Every thread counts into a block of its own without atomic
+ * read-modify-writes, spd_mem_get_stats() adds the blocks up. Like the
+ * log rings, blocks are never freed but handed to new threads. Sampled
+ * call sites go to a small hash table, sites that do not fit are not
+ * recorded. For the peak, every thread also moves its bytes to a
+ * shared total once they changed by SPD_MEM_PEAK_STEP, and raises the
+ * peak from that total, so the peak misses at most that much per thread
+ * without an atomic add on every allocation. A thread whose block was
+ * released on exit, or which could not get one, counts with atomic adds
+ * into the shared totals instead.
  */
-#if 0
-int spd_sched_add_flag(struct scheduler_context * con, int when, spd_scheduler_cb callback, void* data, int flag)
-#else
-int spd_sched_add_flag(struct scheduler_context * con, int when, spd_scheduler_cb callback, void* data, int flag, int retry_times)
-#endif
-{
-    struct scheduler *tmp;
-    int res = -1;
+#define SPD_MEM_SITES    256    /*!< Sampled call sites, power of two */
+#define SPD_MEM_PEAK_STEP (64 * 1024)  /*!< Bytes a thread counts before it updates the peak */
 
-    if (NULL == con)
-    {
-        spd_log(LOG_DEBUG, "scheduler context is NULL!");
-        return -1;
-    }
-    spd_log(LOG_DEBUG,"Enter spd_sched_add \n");
-    if(!flag && (!when || (when < 0))) {
-        spd_log(LOG_DEBUG," if flag is 0, rescheduled can't be 0 or smaller than 0 ! \n");
-        return -1;
-    }
+struct sched_mem_thread {
+    struct sched_mem_thread *next;
+    int owned;                 /*!< A thread counts into this block */
+    uint64_t allocs;
+    uint64_t frees;
+    int64_t bytes;
+    int64_t unshared;          /*!< Bytes not added to sched_mem.bytes yet */
+    unsigned int sample;       /*!< Allocations left until the next sample */
+};
 
-    pthread_mutex_lock(&con->lock);
-    
-    if((tmp = sched_alloc(con))) {
-        tmp->id = con->processedcnt++;
-        tmp->callback = callback;
-        tmp->data = data;
-        tmp->reschedule = when;
-        tmp->flag = flag;
-        tmp->when = spd_tv(0,0);
-        tmp->retry_times = retry_times ? retry_times : 1; /* retry_times is at least 1*/
-        if(sched_settime(&tmp->when, when)) {
-            scheduler_release(con, tmp);
-        } else {
-            struct timeval tv= spd_tvnow();
-            struct timeval delta = spd_tvsub(tmp->when, tv);    
-            spd_log(LOG_DEBUG, "=============================================================\n"
-                                 "|ID    Callback          Data              Time  (sec:ms)   |\n"
-                                 "+-----+-----------------+-----------------+-----------------+\n");
-            spd_log(LOG_DEBUG, "|%.4d | %-15p | %-15p | %.6ld : %.6ld |\n",
-                tmp->id,
-                tmp->callback,
-                tmp->data,
-                delta.tv_sec,
-                (long int)delta.tv_usec);
-            add_scheduler(con, tmp);
-            res = tmp->id;
-        }
-    }
+struct sched_mem_site {
+    const char *file;
+    int line;
+    uint64_t allocs;
+    uint64_t bytes;
+};
 
-#ifdef SPD_SCHED_MA_CACHE  
-    spd_log(LOG_DEBUG, " Schedule Dump (%d in Q, %d Total, %d Cache)\n", con->schedsnt, con->processedcnt- 1, con->schedccnt);
-#else
-    spd_log(LOG_DEBUG, " Schedule Dump (%d in Q, %d Total)\n", con->schedsnt, con->processedcnt- 1);
-#endif
+static struct {
+    pthread_mutex_t lock;      /*!< Protects the thread list and sites */
+    struct sched_mem_thread *threads;
+    unsigned int every;        /*!< Sample one allocation out of every, 0 for none */
+    int64_t bytes;             /*!< Bytes in use, up to SPD_MEM_PEAK_STEP per thread behind */
+    int64_t peak;              /*!< Most of bytes ever seen */
+    uint64_t allocs;           /*!< Blocks allocated by threads without a block of their own */
+    uint64_t frees;            /*!< Blocks freed by threads without a block of their own */
+    int64_t orphan;            /*!< Bytes counted by threads without a block of their own */
+    pthread_once_t once;
+    pthread_key_t key;         /*!< Releases the block of an exiting thread */
+    struct sched_mem_site sites[SPD_MEM_SITES];
+} sched_mem = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .once = PTHREAD_ONCE_INIT,
+};
 
-#ifdef USE_COND_WAIT
-    pthread_cond_signal(&con->cond);
-#endif
-    
-    pthread_mutex_unlock(&con->lock);
-    
-    spd_log(LOG_DEBUG,"Exit spd_sched_add \n");
-    return res;
+static __thread struct sched_mem_thread *sched_mem_self;
+static __thread int sched_mem_gone;   /*!< The block was released, the thread is exiting */
+
+static void sched_mem_release(void *arg)
+{
+    struct sched_mem_thread *t = arg;
+
+    /* later destructors of this thread must not write to a block another thread may own */
+    sched_mem_self = NULL;
+    sched_mem_gone = 1;
+    __atomic_store_n(&t->owned, 0, __ATOMIC_RELEASE);
 }
 
-int spd_sched_add(struct scheduler_context * con, int when, spd_scheduler_cb callback, void * data)
+static void sched_mem_key(void)
 {
-    return spd_sched_add_flag(con, when, callback,data, 0, -1);
+    pthread_key_create(&sched_mem.key, sched_mem_release);
 }
 
 /*! \brief
- * Delete the schedule entry with number
- * "id".  It's nearly impossible that there
- * would be two or more in the list with that
- * id.
+ * The counters of the calling thread, NULL if it can not have them.
  */
-int spd_sched_del(struct scheduler_context * c, int id)
+static struct sched_mem_thread *sched_mem_thread(void)
 {
-    struct scheduler *s;
+    struct sched_mem_thread *t;
 
-    pthread_mutex_lock(&c->lock);
-    SPD_LIST_TRAVERSE_SAFE_BEGIN(&c->schedulerq, s, list) {
-        if(s->id == id) {
-            SPD_LIST_REMOVE_CURRENT(&c->schedulerq, list);
-            c->schedsnt--;
-            scheduler_release(c, s);
-            break;
-        }
+    if (sched_mem_self || sched_mem_gone)
+        return sched_mem_self;
+    pthread_once(&sched_mem.once, sched_mem_key);
+    pthread_mutex_lock(&sched_mem.lock);
+    for (t = sched_mem.threads; t && __atomic_load_n(&t->owned, __ATOMIC_ACQUIRE); t = t->next)
+        ;
+    /* not counted, it would count itself */
+    if (!t && (t = calloc(1, sizeof(*t)))) {
+        t->next = sched_mem.threads;
+        sched_mem.threads = t;
     }
-    SPD_LIST_TRAVERSE_SAFE_END
-    pthread_mutex_unlock(&c->lock);
-
-    if(!s) {
-        //spd_log(LOG_WARNING, "ask to delete null schedule\n");
-        spd_log(LOG_DEBUG,"ask to delete null schedule\n");
-        return -1;
+    if (t) {
+        t->owned = 1;
+        pthread_setspecific(sched_mem.key, t);
     }
-
-    return 0;
+    pthread_mutex_unlock(&sched_mem.lock);
+    return sched_mem_self = t;
 }
 
-void spd_sched_dump(const struct scheduler_context *con)
+/*! \brief
+ * Raise the peak to 'bytes' if that is more.
+ */
+static void sched_mem_peak(int64_t bytes)
 {
-    struct scheduler *q;
-    struct timeval tv= spd_tvnow();
+    int64_t peak = __atomic_load_n(&sched_mem.peak, __ATOMIC_RELAXED);
 
-#ifdef SPD_SCHED_MA_CACHE  
-    spd_log(LOG_DEBUG, " Schedule Dump (%d in Q, %d Total, %d Cache)\n", con->schedsnt, con->processedcnt- 1, con->schedccnt);
-#else
-    spd_log(LOG_DEBUG, " Schedule Dump (%d in Q, %d Total)\n", con->schedsnt, con->processedcnt- 1);
-#endif
+    while (bytes > peak && !__atomic_compare_exchange_n(&sched_mem.peak, &peak, bytes, 1,
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
 
-    spd_log(LOG_DEBUG, "=============================================================\n");
-    spd_log(LOG_DEBUG, "|ID    Callback          Data              Time  (sec:ms)   |\n");
-    spd_log(LOG_DEBUG, "+-----+-----------------+-----------------+-----------------+\n");
-    SPD_LIST_TRAVERSE(&con->schedulerq, q, list) {
-    struct timeval delta = spd_tvsub(q->when, tv);
-        spd_log(LOG_DEBUG, "|%.4d | %-15p | %-15p | %.6ld : %.6ld |\n", 
-            q->id,
-            q->callback,
-            q->data,
-            delta.tv_sec,
-            (long int)delta.tv_usec);
+static void sched_mem_sample(const char *file, int line, size_t size, unsigned int every)
+{
+    struct sched_mem_site *site;
+    unsigned int i, n;
+
+    i = ((unsigned int)(uintptr_t)file * 31U + (unsigned int)line) * 2654435769U;
+    pthread_mutex_lock(&sched_mem.lock);
+    for (n = 0; n < SPD_MEM_SITES; n++, i++) {
+        site = &sched_mem.sites[i & (SPD_MEM_SITES - 1)];
+        if (!site->file) {
+            site->file = file;
+            site->line = line;
+        }
+        if (site->file == file && site->line == line) {
+            site->allocs += every;
+            site->bytes += (uint64_t)size * every;
+            break;
+        }
     }
-    spd_log(LOG_DEBUG, "=============================================================\n");
+    pthread_mutex_unlock(&sched_mem.lock);
 }
 
 /*! \brief
- * Launch all events which need to be run at this time.
+ * Count a block of 'size' bytes allocated (alloc > 0), resized
+ * (alloc == 0) or freed (alloc < 0) by the calling thread.
  */
-int spd_sched_runall(struct scheduler_context * c)
+static void sched_mem_count(int alloc, int64_t size, const char *file, int line)
 {
-    struct scheduler *cur;
+    struct sched_mem_thread *t = sched_mem_thread();
+    unsigned int every;
 
-    struct timeval tv;
-    int numevents;
-    int res;
+    if (!t) {
+        __atomic_add_fetch(&sched_mem.orphan, size, __ATOMIC_RELAXED);
+        sched_mem_peak(__atomic_add_fetch(&sched_mem.bytes, size, __ATOMIC_RELAXED));
+        if (alloc)
+            __atomic_add_fetch(alloc > 0 ? &sched_mem.allocs : &sched_mem.frees, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    /* only this thread writes, the stores are atomic for spd_mem_get_stats() */
+    __atomic_store_n(&t->bytes, t->bytes + size, __ATOMIC_RELAXED);
+    t->unshared += size;
+    if (t->unshared >= SPD_MEM_PEAK_STEP || t->unshared <= -SPD_MEM_PEAK_STEP) {
+        sched_mem_peak(__atomic_add_fetch(&sched_mem.bytes, t->unshared, __ATOMIC_RELAXED));
+        t->unshared = 0;
+    }
+    if (alloc < 0) {
+        __atomic_store_n(&t->frees, t->frees + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    if (alloc > 0)
+        __atomic_store_n(&t->allocs, t->allocs + 1, __ATOMIC_RELAXED);
+    if ((every = __atomic_load_n(&sched_mem.every, __ATOMIC_RELAXED)) && size > 0) {
+        if (!t->sample || t->sample > every)
+            t->sample = every;
+        if (!--t->sample)
+            sched_mem_sample(file, line, size, every);
+    }
+}
+
+void *spd_mem_malloc(size_t size, const char *file, int line)
+{
+    void *mm = malloc(size);
+
+    if (mm)
+        sched_mem_count(1, malloc_usable_size(mm), file, line);
+    return mm;
+}
+
+void *spd_mem_calloc(size_t n, size_t unit, const char *file, int line)
+{
+    void *mm = calloc(n, unit);
+
+    if (mm)
+        sched_mem_count(1, malloc_usable_size(mm), file, line);
+    return mm;
+}
+
+void *spd_mem_realloc(void *ptr, size_t size, const char *file, int line)
+{
+    int64_t old = ptr ? (int64_t)malloc_usable_size(ptr) : 0;
+    void *mm = realloc(ptr, size);
+
+    if (mm)
+        sched_mem_count(!ptr, (int64_t)malloc_usable_size(mm) - old, file, line);
+    else if (ptr && !size)
+        sched_mem_count(-1, -old, file, line);
+    return mm;
+}
+
+void spd_mem_free(void *ptr)
+{
+    if (!ptr)
+        return;
+    sched_mem_count(-1, -(int64_t)malloc_usable_size(ptr), NULL, 0);
+    free(ptr);
+}
+
+void spd_mem_get_stats(struct spd_mem_stats *st)
+{
+    struct sched_mem_thread *t;
+
+    memset(st, 0, sizeof(*st));
+    st->allocs = __atomic_load_n(&sched_mem.allocs, __ATOMIC_RELAXED);
+    st->frees = __atomic_load_n(&sched_mem.frees, __ATOMIC_RELAXED);
+    st->bytes = __atomic_load_n(&sched_mem.orphan, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&sched_mem.lock);
+    for (t = sched_mem.threads; t; t = t->next) {
+        st->allocs += __atomic_load_n(&t->allocs, __ATOMIC_RELAXED);
+        st->frees += __atomic_load_n(&t->frees, __ATOMIC_RELAXED);
+        st->bytes += __atomic_load_n(&t->bytes, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&sched_mem.lock);
+    /* the exact sum may be above what the threads have shared */
+    sched_mem_peak(st->bytes);
+    st->peak = __atomic_load_n(&sched_mem.peak, __ATOMIC_RELAXED);
+}
+
+void spd_mem_set_sample(unsigned int every)
+{
+    __atomic_store_n(&sched_mem.every, every, __ATOMIC_RELAXED);
+}
+
+void spd_mem_walk_sites(spd_mem_site_cb cb, void *arg)
+{
+    struct sched_mem_site sites[SPD_MEM_SITES];
+    int i;
+
+    /* copied so cb may allocate */
+    pthread_mutex_lock(&sched_mem.lock);
+    memcpy(sites, sched_mem.sites, sizeof(sites));
+    pthread_mutex_unlock(&sched_mem.lock);
+    for (i = 0; i < SPD_MEM_SITES; i++) {
+        if (sites[i].file)
+            cb(sites[i].file, sites[i].line, sites[i].allocs, sites[i].bytes, arg);
+    }
+}
+#endif /* MALLOC_DEBUG */
+       
+#define ONE_MILLION    1000000
+
+#define DEBUG_M(a) {\
+    a;  \
+}
+
+#ifdef DEBUG_SCHEDULER
+    #define DEBUG(a) do { \
+    if(option_debug) \
+        DEBUG_M(a)  \
+        } while(0)
+#else 
+#define DEBUG(a)
+#endif
+
+/*! \brief Life cycle of a live event */
+enum sched_state {
+    SCHED_RUNNING = 0,     /*!< Callback is running, can not be deleted */
+    SCHED_QUEUED,          /*!< Waiting in the queue */
+    SCHED_PENDING,         /*!< Expired and handed to a worker, not started yet */
+    SCHED_CANCELLED,       /*!< Deleted while pending, the worker drops it */
+    SCHED_DONE,            /*!< Ran in a runall batch and has its next time, waiting to be requeued */
+};
+
+struct scheduler {
+    int flag;              /*!< Use return value from callback to reschedule */
+    int state;             /*!< SCHED_QUEUED, SCHED_PENDING, ... */
+    int reschedule;        /*!< When to reschedule (only if flag is false). */
+    int id;                /*!< ID number of event, 0 if it is only known by handle */
+    unsigned int slot;     /*!< Handle slot number plus one, 0 if it is known by id */
+    int retry_times;       /*!< Total retry times, negative value will always retry. */
+    int result;            /*!< Return value of the last callback run, until it is requeued */
+    unsigned int qindex;   /*!< Heap position or timing wheel slot of this event */
+    unsigned int slack;    /*!< Milliseconds the event may run late to share a wakeup */
+    unsigned char periodic;     /*!< Added by spd_sched_add_periodic(), reschedule is the period */
+    unsigned char period_mode;  /*!< enum spd_sched_period of a periodic event */
+    unsigned char catchup;      /*!< enum spd_sched_catchup of a periodic event */
+    unsigned int missed;   /*!< Ticks of a periodic event to report to its next run */
+    spd_ns_t when;         /*!< Absolute time event should take place, monotonic */
+    union {
+        spd_scheduler_cb callback;
+        spd_sched_periodic_cb tick;  /*!< Callback of a periodic event */
+    };
+    void *data;
+    spd_sched_destroy_cb destroy;    /*!< Frees data when the event goes away, NULL to leave it */
+    SPD_LIST_ENTRY(scheduler)list;
+    struct scheduler *inbox_next;    /*!< Next event pushed on the inbox */
+    struct scheduler *wheel_next;    /*!< Next event in the same timing wheel slot */
+    struct scheduler **wheel_pprev;  /*!< Link that points at this event in its wheel slot */
+    /* keep last, it is not cleared when the event is allocated */
+    unsigned char payload[SPD_SCHED_INLINE_DATA] __attribute__((aligned(16))); /*!< Inline copy of data */
+};
+
+/*! \brief Fan-out of the schedule queue heap.
+ * \note A 4-ary heap is half as deep as a binary one and the four children
+ * of a node sit next to each other, so one sift step touches a single
+ * cache line of the entry array.
+ */
+#define SPD_SCHED_HEAP_ARITY    4
+#define SPD_SCHED_HEAP_INITIAL  64
+
+/*! \brief Layout of the hierarchical timing wheel.
+ * \note The inner wheel has 256 slots of 1ms each, the four outer wheels
+ * have 64 slots each covering the whole span of the wheel below, so
+ * events up to 2^32ms (about 49 days) ahead are placed without overflow.
+ * Later events are parked in the last slot and cascaded again.
+ */
+#define SPD_SCHED_WHEEL_BITS0   8
+#define SPD_SCHED_WHEEL_BITS    6
+#define SPD_SCHED_WHEEL_SIZE0   (1 << SPD_SCHED_WHEEL_BITS0)
+#define SPD_SCHED_WHEEL_SIZE    (1 << SPD_SCHED_WHEEL_BITS)
+#define SPD_SCHED_WHEEL_OUTER   4
+#define SPD_SCHED_WHEEL_SLOTS   (SPD_SCHED_WHEEL_SIZE0 + SPD_SCHED_WHEEL_OUTER * SPD_SCHED_WHEEL_SIZE)
+#define SPD_SCHED_WHEEL_DUE     SPD_SCHED_WHEEL_SLOTS   /*!< qindex of events on the expired list */
+#define SPD_SCHED_WHEEL_MAXSPAN 0xffffffffLL
+
+struct sched_wheel {
+    spd_ns_t origin;                                   /*!< Time of tick 0 */
+    long long tick;                                    /*!< Next tick (ms since origin) to expire */
+    unsigned int pending;                              /*!< Events in the slots, not on the due list */
+    struct scheduler *due;                             /*!< Expired events not run yet, in expiry order */
+    struct scheduler **duetail;                        /*!< Link to append the next expired event at */
+    struct scheduler *slots[SPD_SCHED_WHEEL_SLOTS];
+};
+
+/*! \brief Initial size of the id index, must be a power of two.
+ * \note The index is an open addressing table with linear probing,
+ * kept at most half full.
+ */
+#define SPD_SCHED_INDEX_INITIAL 64
+
+/*! \brief Handle slot.
+ * \note A handle is the slot number plus one in its low 32 bits and the
+ * slot generation in its high 32 bits. The generation moves on every
+ * time the slot is freed, so handles of finished events stop matching.
+ */
+struct sched_slot {
+    struct scheduler *sched;                           /*!< Event owning the slot, NULL if free */
+    unsigned int gen;                                  /*!< Generation of the slot, never 0 */
+    unsigned int nextfree;                             /*!< Next free slot plus one */
+};
+
+#define SPD_SCHED_SLOT_INITIAL  64
+
+/*! \brief File descriptor watched by spd_sched_loop_run() */
+struct sched_fd {
+    spd_sched_fd_cb callback;                          /*!< NULL if the descriptor is not watched */
+    void *data;
+    int events;
+};
+
+#define SPD_SCHED_FD_INITIAL    64
+#define SPD_SCHED_LOOP_EVENTS   64
+
+/*! \brief Deadline of a sleep that only ends when signalled */
+#define SPD_SCHED_NEVER         INT64_MAX
+
+struct scheduler_context {
+    pthread_mutex_t lock;
+    unsigned int processedcnt;                         /*!< Number of events processed */
+    unsigned int schedsnt;                             /*!< Number of outstanding schedule events */
+    enum spd_sched_queue qtype;                        /*!< Which structure orders the queue */
+    struct scheduler **schedulerq;                     /*!< Schedule main queue, a min-heap on 'when' */
+    unsigned int schedqmax;                            /*!< Allocated slots in schedulerq */
+    struct sched_wheel *wheel;                         /*!< Schedule main queue, for SPD_SCHED_QUEUE_WHEEL */
+    struct scheduler **idindex;                        /*!< Live events by id, in any state */
+    unsigned int idmask;                               /*!< Size of idindex minus one */
+    unsigned int idcnt;                                /*!< Events in idindex */
+    struct sched_slot *slots;                          /*!< Handle slots of events added by handle */
+    unsigned int slotmax;                              /*!< Allocated slots */
+    unsigned int slotfree;                             /*!< First free slot plus one, 0 if none */
+    unsigned int idshift;                              /*!< Low id bits reserved for idtag */
+    unsigned int idtag;                                /*!< Value of the low id bits, the shard number */
+#ifdef USE_COND_WAIT
+    pthread_cond_t cond;
+#endif
+    int stop;                                          /*!< Set to make the dispatcher threads exit */
+    int nworkers;                                      /*!< Worker threads started by spd_sched_start */
+    pthread_t dispatcher;
+    pthread_t *workers;
+    pthread_mutex_t joblock;                           /*!< Protects jobq */
+    pthread_cond_t jobcond;                            /*!< Signalled when jobq gets events */
+    SPD_LIST_HEAD_NOLOCK(, scheduler)jobq;             /*!< Expired events waiting for a worker */
+    int lockfree;                                      /*!< spd_sched_add_flag pushes on the inbox */
+    int idwrapped;                                     /*!< The id counter went round, ids need the index */
+    int waiting;                                       /*!< Threads sleeping on cond */
+    spd_ns_t waketime;                                 /*!< When the last of them wakes up by itself */
+    int timerfd;                                       /*!< timerfd of spd_sched_get_fd, -1 if none */
+    spd_ns_t timerarmed;                               /*!< Expiry the timerfd is armed for */
+#ifdef USE_IO_URING
+    struct sched_uring *uring;                         /*!< Ring of spd_sched_uring_wait, NULL if none */
+#endif
+    int epfd;                                          /*!< epoll of spd_sched_loop_run, -1 if none */
+    int evfd;                                          /*!< eventfd waking spd_sched_loop_run */
+    int loopstop;                                      /*!< Set to make spd_sched_loop_run return */
+    struct sched_fd *fdtab;                            /*!< Watched descriptors, indexed by fd */
+    unsigned int fdmax;                                /*!< Allocated entries in fdtab */
+    struct spd_sched_stats stats;                      /*!< Counters, depth is not kept up to date */
+#ifdef SPD_SCHED_LOCK_STATS
+    spd_ns_t lockedat;                                 /*!< When the lock holder got the lock */
+#endif
+#ifdef MALLOC_DEBUG
+    size_t memused;                                    /*!< Bytes held by the context and its events */
+    size_t mempeak;                                    /*!< Most bytes ever held */
+#endif
+    struct scheduler *intail;                          /*!< Oldest event of the inbox, drained under lock */
+    struct scheduler instub;                           /*!< Inbox stub node */
+    /*! Newest event of the inbox, on its own cache line as every producer swaps it */
+    struct scheduler *inhead __attribute__((aligned(64)));
+};
+
+#ifdef MALLOC_DEBUG
+/*! \brief
+ * Count 'delta' bytes more held by context c. Must be called with
+ * the context locked or before it is shared.
+ */
+static inline void sched_mem_charge(struct scheduler_context *c, long delta)
+{
+    c->memused += delta;
+    if (c->memused > c->mempeak)
+        c->mempeak = c->memused;
+}
+#else
+#define sched_mem_charge(c, delta)
+#endif /* MALLOC_DEBUG */
+
+/*! \brief Count into a field of spd_sched_stats, with or without the context lock */
+static inline void sched_stat_add(uint64_t *counter, uint64_t n)
+{
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static inline int sched_hist_bucket(uint64_t v)
+{
+    int e;
+
+    if (v < SPD_SCHED_HIST_SUB)
+        return (int)v;
+    if (v > 0xffffffffULL)
+        return SPD_SCHED_HIST_BUCKETS - 1;
+    e = 63 - __builtin_clzll(v);
+    return (e - 1) * SPD_SCHED_HIST_SUB + (int)((v >> (e - 2)) & (SPD_SCHED_HIST_SUB - 1));
+}
+
+static void sched_hist_put(struct spd_sched_hist *h, uint64_t v)
+{
+    uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+    sched_stat_add(&h->count[sched_hist_bucket(v)], 1);
+    sched_stat_add(&h->sum, v);
+    while (v > max && !__atomic_compare_exchange_n(&h->max, &max, v, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/*! \brief Count a time in the microsecond histogram h */
+static inline void sched_hist_add(struct spd_sched_hist *h, spd_ns_t ns)
+{
+    sched_hist_put(h, ns > 0 ? (uint64_t)ns / SPD_NS_PER_US : 0);
+}
+
+#ifdef SPD_SCHED_LOCK_STATS
+/*! \brief Context lock with wait and hold times
+ * \note The wait is only timed when the lock is busy. The holder
+ * notes when it got the lock, a condition wait counts as a release.
+ */
+static inline void sched_lock_acquired(struct scheduler_context *c, spd_ns_t start)
+{
+    c->lockedat = spd_nsnow();
+    sched_hist_put(&c->stats.lockwait, start ? (uint64_t)(c->lockedat - start) : 0);
+}
+
+static inline void sched_lock_released(struct scheduler_context *c)
+{
+    sched_hist_put(&c->stats.lockhold, (uint64_t)(spd_nsnow() - c->lockedat));
+}
+
+static inline void sched_mutex_lock(struct scheduler_context *c)
+{
+    spd_ns_t start = 0;
+
+    if (pthread_mutex_trylock(&c->lock)) {
+        start = spd_nsnow();
+        pthread_mutex_lock(&c->lock);
+    }
+    sched_lock_acquired(c, start);
+}
+
+static inline int sched_mutex_trylock(struct scheduler_context *c)
+{
+    if (pthread_mutex_trylock(&c->lock))
+        return -1;
+    sched_lock_acquired(c, 0);
+    return 0;
+}
+
+static inline void sched_mutex_unlock(struct scheduler_context *c)
+{
+    sched_lock_released(c);
+    pthread_mutex_unlock(&c->lock);
+}
+#else
+#define sched_lock_acquired(c, start)
+#define sched_lock_released(c)
+#define sched_mutex_lock(c)      pthread_mutex_lock(&(c)->lock)
+#define sched_mutex_trylock(c)   pthread_mutex_trylock(&(c)->lock)
+#define sched_mutex_unlock(c)    pthread_mutex_unlock(&(c)->lock)
+#endif /* SPD_SCHED_LOCK_STATS */
+
+struct timeval spd_tvadd(struct timeval a, struct timeval b);
+struct timeval spd_tvsub(struct timeval a, struct timeval b);
+/*
+ * put timeval in a valid range. usec is 0..999999
+ * negative values are not allowed and truncated.
+ */
+static struct timeval tvfix(struct timeval a);
+
+static struct scheduler *sched_queue_walk(const struct scheduler_context *c,
+    int (*fn)(struct scheduler *s, void *arg), void *arg);
+static void sched_lock(struct scheduler_context *c);
+static void sched_free(struct scheduler *s);
+#ifdef USE_IO_URING
+struct sched_uring;
+static void sched_uring_destroy(struct sched_uring *u);
+static int sched_uring_wake_needed(struct scheduler_context *c, spd_ns_t when);
+static void sched_uring_wake(struct scheduler_context *c, spd_ns_t when);
+#endif
+
+struct scheduler_context *spd_sched_context_create(void)
+{
+    return spd_sched_context_create_type(SPD_SCHED_QUEUE_HEAP);
+}
+
+struct scheduler_context *spd_sched_context_create_type(enum spd_sched_queue type)
+{
+    struct scheduler_context *sc;
+#ifdef USE_COND_WAIT
+    pthread_condattr_t cattr;
+#endif
+
+#ifdef MALLOC_DEBUG
+    if(!(sc = LOG_CALLOC(1, sizeof(*sc)))) {
+#else
+    if(!(sc = calloc(1, sizeof(*sc)))) {
+#endif
+        return NULL;
+    }
+
+    pthread_mutex_init(&sc->lock, NULL /*&attr*/);
+#ifdef USE_COND_WAIT
+    /* timed waits are given event times, which are monotonic */
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&sc->cond, &cattr);
+    pthread_condattr_destroy(&cattr);
+#endif
+    pthread_mutex_init(&sc->joblock, NULL);
+    pthread_cond_init(&sc->jobcond, NULL);
+    SPD_LIST_HEAD_INIT_NOLOCK(&sc->jobq);
+    sc->inhead = sc->intail = &sc->instub;
+    sc->timerfd = -1;
+    sc->timerarmed = SPD_SCHED_NEVER;
+    sc->epfd = sc->evfd = -1;
+    sc->nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (sc->nworkers < 1)
+        sc->nworkers = 1;
+    
+    sc->processedcnt = 1;
+    sc->schedsnt = 0;
+    sc->qtype = type;
+    if (type == SPD_SCHED_QUEUE_WHEEL) {
+        if ((sc->wheel = SCHED_CALLOC(1, sizeof(*sc->wheel)))) {
+            sc->wheel->origin = spd_nsnow();
+            sc->wheel->duetail = &sc->wheel->due;
+        }
+    } else if ((sc->schedulerq = SCHED_CALLOC(SPD_SCHED_HEAP_INITIAL, sizeof(*sc->schedulerq)))) {
+        sc->schedqmax = SPD_SCHED_HEAP_INITIAL;
+    }
+    if ((sc->idindex = SCHED_CALLOC(SPD_SCHED_INDEX_INITIAL, sizeof(*sc->idindex)))) {
+        sc->idmask = SPD_SCHED_INDEX_INITIAL - 1;
+    }
+    if ((!sc->wheel && !sc->schedulerq) || !sc->idindex) {
+        SAFE_FREE(sc->schedulerq);
+        SAFE_FREE(sc->wheel);
+        SAFE_FREE(sc->idindex);
+        pthread_mutex_destroy(&sc->lock);
+#ifdef USE_COND_WAIT
+        pthread_cond_destroy(&sc->cond);
+#endif
+        pthread_mutex_destroy(&sc->joblock);
+        pthread_cond_destroy(&sc->jobcond);
+        SAFE_FREE(sc);
+        return NULL;
+    }
+    sched_mem_charge(sc, sizeof(*sc) + (sc->wheel ? sizeof(*sc->wheel) : 0)
+        + sc->schedqmax * sizeof(*sc->schedulerq) + SPD_SCHED_INDEX_INITIAL * sizeof(*sc->idindex));
+    return sc;
+}
+
+static int sched_free_entry(struct scheduler *s, void *arg)
+{
+    (void)arg;
+    if (s->destroy && s->data)
+        s->destroy(s->data);
+    sched_free(s);
+    return 0;
+}
+
+void spd_sche_context_destroy(struct scheduler_context *sc)
+{
+    spd_sched_stop(sc);
+    sched_log_drain();
+
+    sched_lock(sc);    
+#ifdef USE_COND_WAIT
+    pthread_cond_destroy(&sc->cond);
+#endif
+
+    sched_queue_walk(sc, sched_free_entry, NULL);
+    sc->schedsnt = 0;
+    SAFE_FREE(sc->schedulerq);
+    SAFE_FREE(sc->wheel);
+    SAFE_FREE(sc->idindex);
+    SAFE_FREE(sc->slots);
+    if (sc->timerfd >= 0)
+        close(sc->timerfd);
+#ifdef USE_IO_URING
+    sched_uring_destroy(sc->uring);
+#endif
+    if (sc->epfd >= 0)
+        close(sc->epfd);
+    if (sc->evfd >= 0)
+        close(sc->evfd);
+    SAFE_FREE(sc->fdtab);
+
+    sched_mutex_unlock(sc);
+
+    pthread_mutex_destroy(&sc->lock);
+    pthread_mutex_destroy(&sc->joblock);
+    pthread_cond_destroy(&sc->jobcond);
+
+    SAFE_FREE(sc);
+}
+
+#ifdef SPD_SCHED_MA_CACHE
+/*! \brief Slab allocator of struct scheduler
+ * \note Entries are carved out of chunks aligned on their size, so the
+ * chunk of an entry is found by masking its address, and each entry
+ * starts on a cache line of its own. Every thread keeps up to
+ * SPD_SCHED_MA_CACHE free entries in a magazine and only takes the
+ * slab lock to move half a magazine from or to the depot, so
+ * producers allocate without the context lock. The slab is shared by
+ * all contexts. Chunks whose entries are all free are unmapped by
+ * spd_sched_trim().
+ */
+#ifdef SPD_SCHED_SLAB_HUGEPAGE
+#define SPD_SCHED_SLAB_CHUNK    (2 * 1024 * 1024)
+#else
+#define SPD_SCHED_SLAB_CHUNK    (64 * 1024)
+#endif
+#define SPD_SCHED_SLAB_ALIGN    64
+#define SPD_SCHED_SLAB_ROUND(n) (((n) + SPD_SCHED_SLAB_ALIGN - 1) & ~(size_t)(SPD_SCHED_SLAB_ALIGN - 1))
+#define SPD_SCHED_SLAB_OBJSIZE  SPD_SCHED_SLAB_ROUND(sizeof(struct scheduler))
+#define SPD_SCHED_SLAB_PERCHUNK ((SPD_SCHED_SLAB_CHUNK - SPD_SCHED_SLAB_ROUND(sizeof(struct sched_chunk))) / SPD_SCHED_SLAB_OBJSIZE)
+#define SCHED_ENTRY_SIZE        SPD_SCHED_SLAB_OBJSIZE
+
+struct sched_chunk {
+    struct sched_chunk *next;                          /*!< Next chunk with free entries */
+    struct sched_chunk *prev;
+    struct scheduler *free;                            /*!< Free entries, linked by inbox_next */
+    unsigned int used;                                 /*!< Entries handed out, magazines included */
+};
+
+struct sched_magazine {
+    unsigned int n;
+    struct scheduler *obj[SPD_SCHED_MA_CACHE];
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct sched_chunk *avail;                         /*!< Chunks with free entries */
+    unsigned int nfree;                                /*!< Free entries in the chunks */
+    unsigned int nchunks;
+    pthread_once_t once;
+    pthread_key_t key;                                 /*!< Flushes the magazine of an exiting thread */
+} sched_slab = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .once = PTHREAD_ONCE_INIT,
+};
+
+static __thread struct sched_magazine *sched_mag;
+
+static inline struct sched_chunk *sched_chunk_of(struct scheduler *s)
+{
+    return (struct sched_chunk *)((uintptr_t)s & ~(uintptr_t)(SPD_SCHED_SLAB_CHUNK - 1));
+}
+
+static inline void sched_chunk_link(struct sched_chunk *ch)
+{
+    ch->prev = NULL;
+    if ((ch->next = sched_slab.avail))
+        ch->next->prev = ch;
+    sched_slab.avail = ch;
+}
+
+static inline void sched_chunk_unlink(struct sched_chunk *ch)
+{
+    if (ch->prev)
+        ch->prev->next = ch->next;
+    else
+        sched_slab.avail = ch->next;
+    if (ch->next)
+        ch->next->prev = ch->prev;
+}
+
+/*! \brief
+ * Map a new chunk and put its entries on the depot.
+ * Must be called with the slab locked.
+ */
+static int sched_slab_grow(void)
+{
+    struct sched_chunk *ch;
+    struct scheduler *s;
+    char *p = MAP_FAILED, *base;
+    unsigned int i;
+
+#ifdef SPD_SCHED_SLAB_HUGEPAGE
+    p = mmap(NULL, SPD_SCHED_SLAB_CHUNK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    if (p == MAP_FAILED) {
+        /* map twice the size and cut an aligned chunk out of it */
+        p = mmap(NULL, 2 * SPD_SCHED_SLAB_CHUNK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            spd_log(LOG_WARNING, "failed to map a scheduler slab: %s\n", strerror(errno));
+            return -1;
+        }
+        base = (char *)(((uintptr_t)p + SPD_SCHED_SLAB_CHUNK - 1) & ~(uintptr_t)(SPD_SCHED_SLAB_CHUNK - 1));
+        if (base > p)
+            munmap(p, base - p);
+        if (p + SPD_SCHED_SLAB_CHUNK > base)
+            munmap(base + SPD_SCHED_SLAB_CHUNK, p + SPD_SCHED_SLAB_CHUNK - base);
+        p = base;
+    }
+
+    ch = (struct sched_chunk *)p;
+    ch->free = NULL;
+    ch->used = 0;
+    for (i = SPD_SCHED_SLAB_PERCHUNK; i-- > 0; ) {
+        s = (struct scheduler *)(p + SPD_SCHED_SLAB_ROUND(sizeof(*ch)) + i * SPD_SCHED_SLAB_OBJSIZE);
+        s->inbox_next = ch->free;
+        ch->free = s;
+    }
+    sched_chunk_link(ch);
+    sched_slab.nfree += SPD_SCHED_SLAB_PERCHUNK;
+    sched_slab.nchunks++;
+    return 0;
+}
+
+/*! \brief
+ * Take up to n entries from the depot, mapping chunks as needed.
+ * \return the number of entries taken
+ */
+static unsigned int sched_slab_get(struct scheduler **objs, unsigned int n)
+{
+    struct sched_chunk *ch;
+    unsigned int got;
+
+    pthread_mutex_lock(&sched_slab.lock);
+    for (got = 0; got < n; got++) {
+        if (!(ch = sched_slab.avail) && (sched_slab_grow() || !(ch = sched_slab.avail)))
+            break;
+        objs[got] = ch->free;
+        ch->free = ch->free->inbox_next;
+        ch->used++;
+        sched_slab.nfree--;
+        if (!ch->free)
+            sched_chunk_unlink(ch);
+    }
+    pthread_mutex_unlock(&sched_slab.lock);
+    return got;
+}
+
+static void sched_slab_put(struct scheduler **objs, unsigned int n)
+{
+    struct sched_chunk *ch;
+    unsigned int i;
+
+    pthread_mutex_lock(&sched_slab.lock);
+    for (i = 0; i < n; i++) {
+        ch = sched_chunk_of(objs[i]);
+        if (!ch->free)
+            sched_chunk_link(ch);
+        objs[i]->inbox_next = ch->free;
+        ch->free = objs[i];
+        ch->used--;
+        sched_slab.nfree++;
+    }
+    pthread_mutex_unlock(&sched_slab.lock);
+}
+
+static void sched_magazine_flush(void *arg)
+{
+    struct sched_magazine *m = arg;
+
+    sched_slab_put(m->obj, m->n);
+    SAFE_FREE(m);
+    /* an event freed by a later destructor gets a new magazine */
+    sched_mag = NULL;
+}
+
+static void sched_magazine_key(void)
+{
+    pthread_key_create(&sched_slab.key, sched_magazine_flush);
+}
+
+/*! \brief
+ * The magazine of the calling thread, NULL if it can not have one.
+ */
+static struct sched_magazine *sched_magazine(void)
+{
+    if (!sched_mag) {
+        pthread_once(&sched_slab.once, sched_magazine_key);
+        if ((sched_mag = SCHED_CALLOC(1, sizeof(*sched_mag))))
+            pthread_setspecific(sched_slab.key, sched_mag);
+    }
+    return sched_mag;
+}
+
+/*! \brief
+ * Get a zeroed entry. Does not need the context lock.
+ */
+static struct scheduler *sched_alloc(void)
+{
+    struct sched_magazine *m = sched_magazine();
+    struct scheduler *tmp;
+
+    if (!m) {
+        if (!sched_slab_get(&tmp, 1))
+            return NULL;
+    } else {
+        if (!m->n && !(m->n = sched_slab_get(m->obj, SPD_SCHED_MA_CACHE / 2)))
+            return NULL;
+        tmp = m->obj[--m->n];
+    }
+    memset(tmp, 0, offsetof(struct scheduler, payload));
+    return tmp;
+}
+
+static void sched_free(struct scheduler *s)
+{
+    struct sched_magazine *m = sched_magazine();
+
+    if (!m) {
+        sched_slab_put(&s, 1);
+        return;
+    }
+    if (m->n == SPD_SCHED_MA_CACHE) {
+        sched_slab_put(m->obj + SPD_SCHED_MA_CACHE / 2, SPD_SCHED_MA_CACHE / 2);
+        m->n = SPD_SCHED_MA_CACHE / 2;
+    }
+    m->obj[m->n++] = s;
+}
+
+static int sched_slab_reserve(unsigned int n)
+{
+    int res = 0;
+
+    pthread_mutex_lock(&sched_slab.lock);
+    while (sched_slab.nfree < n && !(res = sched_slab_grow()))
+        ;
+    pthread_mutex_unlock(&sched_slab.lock);
+    return res;
+}
+
+/*! \brief
+ * Give the magazine of the calling thread back and unmap the
+ * chunks none of whose entries are in use.
+ */
+static void sched_slab_trim(void)
+{
+    struct sched_chunk *ch, *next;
+
+    if (sched_mag && sched_mag->n) {
+        sched_slab_put(sched_mag->obj, sched_mag->n);
+        sched_mag->n = 0;
+    }
+    pthread_mutex_lock(&sched_slab.lock);
+    for (ch = sched_slab.avail; ch; ch = next) {
+        next = ch->next;
+        if (ch->used)
+            continue;
+        sched_chunk_unlink(ch);
+        sched_slab.nfree -= SPD_SCHED_SLAB_PERCHUNK;
+        sched_slab.nchunks--;
+        munmap(ch, SPD_SCHED_SLAB_CHUNK);
+    }
+    pthread_mutex_unlock(&sched_slab.lock);
+}
+#else
+#define SCHED_ENTRY_SIZE        sizeof(struct scheduler)
+
+static struct scheduler *sched_alloc(void)
+{
+    return SCHED_CALLOC(1, sizeof(struct scheduler));
+}
+
+static void sched_free(struct scheduler *s)
+{
+    SAFE_FREE(s);
+}
+
+static int sched_slab_reserve(unsigned int n)
+{
+    return 0;
+}
+
+static void sched_slab_trim(void)
+{
+}
+#endif /* SPD_SCHED_MA_CACHE */
+
+static inline unsigned int sched_index_hash(const struct scheduler_context *c, int id)
+{
+    /* Fibonacci hashing, ids are sequential so spread them over the table */
+    return ((unsigned int)id * 2654435769U) & c->idmask;
+}
+
+/*! \brief
+ * Find the live event with number "id", NULL if there is none.
+ */
+static struct scheduler *sched_index_find(const struct scheduler_context *c, int id)
+{
+    unsigned int i;
+    struct scheduler *s;
+
+    for (i = sched_index_hash(c, id); (s = c->idindex[i]); i = (i + 1) & c->idmask) {
+        if (s->id == id)
+            return s;
+    }
+    return NULL;
+}
+
+/*! \brief
+ * Rehash the id index into 'buckets' buckets, a power of two.
+ */
+static int sched_index_resize(struct scheduler_context *c, unsigned int buckets)
+{
+    struct scheduler **old = c->idindex;
+    unsigned int oldmask = c->idmask;
+    unsigned int i, j;
+
+    if (!(c->idindex = SCHED_CALLOC(buckets, sizeof(*c->idindex)))) {
+        c->idindex = old;
+        return -1;
+    }
+    c->idmask = buckets - 1;
+    sched_mem_charge(c, ((long)buckets - (long)oldmask - 1) * (long)sizeof(*c->idindex));
+    for (i = 0; i <= oldmask; i++) {
+        if (!old[i])
+            continue;
+        for (j = sched_index_hash(c, old[i]->id); c->idindex[j]; j = (j + 1) & c->idmask)
+            ;
+        c->idindex[j] = old[i];
+    }
+    SAFE_FREE(old);
+    return 0;
+}
+
+static int sched_index_add(struct scheduler_context *c, struct scheduler *s)
+{
+    unsigned int i;
+
+    if ((c->idcnt + 1) * 2 > c->idmask + 1 && sched_index_resize(c, (c->idmask + 1) * 2))
+        return -1;
+
+    for (i = sched_index_hash(c, s->id); c->idindex[i]; i = (i + 1) & c->idmask)
+        ;
+    c->idindex[i] = s;
+    c->idcnt++;
+    sched_mem_charge(c, SCHED_ENTRY_SIZE);
+    return 0;
+}
+
+/*! \brief
+ * Drop an event from the id index. The following entries of the
+ * probe sequence are shifted back so lookups need no tombstones.
+ */
+static void sched_index_del(struct scheduler_context *c, struct scheduler *s)
+{
+    unsigned int i, j, home;
+
+    for (i = sched_index_hash(c, s->id); c->idindex[i] != s; i = (i + 1) & c->idmask) {
+        if (!c->idindex[i])
+            return;
+    }
+    c->idindex[i] = NULL;
+    c->idcnt--;
+    sched_mem_charge(c, -(long)SCHED_ENTRY_SIZE);
+
+    for (j = (i + 1) & c->idmask; c->idindex[j]; j = (j + 1) & c->idmask) {
+        home = sched_index_hash(c, c->idindex[j]->id);
+        /* move entry j into the hole at i unless its home lies in (i, j] */
+        if (((j - home) & c->idmask) >= ((j - i) & c->idmask)) {
+            c->idindex[i] = c->idindex[j];
+            c->idindex[j] = NULL;
+            i = j;
+        }
+    }
+}
+
+/*! \brief
+ * Next id for an event added by id. Ids stay positive and skip
+ * numbers still held by a live event after they wrap. The low
+ * idshift bits of every id are idtag.
+ * \param wrapped set if the id may already be in use
+ */
+static inline int sched_alloc_id_wrapped(struct scheduler_context *c, int *wrapped)
+{
+    unsigned int n = __atomic_fetch_add(&c->processedcnt, 1, __ATOMIC_RELAXED);
+    unsigned int range = INT_MAX >> c->idshift;
+
+    if (n - 1 >= range || __atomic_load_n(&c->idwrapped, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&c->idwrapped, 1, __ATOMIC_RELAXED);
+        *wrapped = 1;
+    }
+    return (int)(((((n - 1) % range) + 1) << c->idshift) | c->idtag);
+}
+
+static inline int sched_alloc_id(struct scheduler_context *c)
+{
+    int wrapped = 0;
+
+    return sched_alloc_id_wrapped(c, &wrapped);
+}
+
+static int sched_next_id(struct scheduler_context *c)
+{
+    int id;
+
+    do {
+        id = sched_alloc_id(c);
+    } while (sched_index_find(c, id));
+    return id;
+}
+
+/*! \brief
+ * Give an event a handle slot.
+ * \return the handle, SPD_SCHED_HANDLE_INVALID if the slot table could not grow.
+ */
+static spd_sched_handle_t sched_slot_add(struct scheduler_context *c, struct scheduler *s)
+{
+    struct sched_slot *slots;
+    unsigned int i, max;
+
+    if (!c->slotfree) {
+        max = c->slotmax ? c->slotmax * 2 : SPD_SCHED_SLOT_INITIAL;
+        if (!(slots = SCHED_REALLOC(c->slots, max * sizeof(*slots))))
+            return SPD_SCHED_HANDLE_INVALID;
+        for (i = c->slotmax; i < max; i++) {
+            slots[i].sched = NULL;
+            slots[i].gen = 1;
+            slots[i].nextfree = i + 2 <= max ? i + 2 : 0;
+        }
+        sched_mem_charge(c, (long)(max - c->slotmax) * (long)sizeof(*slots));
+        c->slotfree = c->slotmax + 1;
+        c->slots = slots;
+        c->slotmax = max;
+    }
+
+    i = c->slotfree - 1;
+    c->slotfree = c->slots[i].nextfree;
+    c->slots[i].sched = s;
+    s->slot = i + 1;
+    sched_mem_charge(c, SCHED_ENTRY_SIZE);
+    return ((spd_sched_handle_t)c->slots[i].gen << 32) | s->slot;
+}
+
+/*! \brief
+ * Resolve a handle, NULL if its event is gone.
+ */
+static struct scheduler *sched_slot_find(const struct scheduler_context *c, spd_sched_handle_t handle)
+{
+    unsigned int slot = (unsigned int)(handle & 0xffffffffU);
+
+    if (!slot || slot > c->slotmax || c->slots[slot - 1].gen != (unsigned int)(handle >> 32))
+        return NULL;
+    return c->slots[slot - 1].sched;
+}
+
+static void sched_slot_del(struct scheduler_context *c, struct scheduler *s)
+{
+    struct sched_slot *slot = &c->slots[s->slot - 1];
+
+    slot->sched = NULL;
+    if (!++slot->gen)
+        slot->gen = 1;
+    slot->nextfree = c->slotfree;
+    c->slotfree = s->slot;
+    s->slot = 0;
+    sched_mem_charge(c, -(long)SCHED_ENTRY_SIZE);
+}
+
+static void scheduler_release(struct scheduler_context *con, struct scheduler *sc)
+{
+        if (!sc) {
+                return;
+        }        
+        if (sc->slot)
+            sched_slot_del(con, sc);
+        else
+            sched_index_del(con, sc);
+        if (sc->destroy && sc->data)
+            sc->destroy(sc->data);
+        sched_free(sc);
+}
+
+static inline void sched_heap_set(struct scheduler_context *c, unsigned int i, struct scheduler *s)
+{
+    c->schedulerq[i] = s;
+    s->qindex = i;
+}
+
+/*! \brief
+ * Move the entry at position i towards the root
+ * until its parent is not later than it.
+ */
+static void sched_heap_up(struct scheduler_context *c, unsigned int i)
+{
+    struct scheduler *s = c->schedulerq[i];
+    unsigned int parent;
+
+    while (i > 0) {
+        parent = (i - 1) / SPD_SCHED_HEAP_ARITY;
+        if (s->when >= c->schedulerq[parent]->when)
+            break;
+        sched_heap_set(c, i, c->schedulerq[parent]);
+        i = parent;
+    }
+    sched_heap_set(c, i, s);
+}
+
+/*! \brief
+ * Move the entry at position i towards the leaves
+ * until none of its children is earlier than it.
+ */
+static void sched_heap_down(struct scheduler_context *c, unsigned int i)
+{
+    struct scheduler *s = c->schedulerq[i];
+    unsigned int child, last, min;
+
+    for (;;) {
+        child = i * SPD_SCHED_HEAP_ARITY + 1;
+        if (child >= c->schedsnt)
+            break;
+        last = child + SPD_SCHED_HEAP_ARITY;
+        if (last > c->schedsnt)
+            last = c->schedsnt;
+        for (min = child++; child < last; child++) {
+            if (c->schedulerq[child]->when < c->schedulerq[min]->when)
+                min = child;
+        }
+        if (c->schedulerq[min]->when >= s->when)
+            break;
+        sched_heap_set(c, i, c->schedulerq[min]);
+        i = min;
+    }
+    sched_heap_set(c, i, s);
+}
+
+/*! \brief
+ * Take the entry at position i out of the queue.
+ */
+static void sched_heap_remove(struct scheduler_context *c, unsigned int i)
+{
+    struct scheduler *last = c->schedulerq[--c->schedsnt];
+
+    if (i == c->schedsnt)
+        return;
+    sched_heap_set(c, i, last);
+    if (i > 0 && last->when < c->schedulerq[(i - 1) / SPD_SCHED_HEAP_ARITY]->when)
+        sched_heap_up(c, i);
+    else
+        sched_heap_down(c, i);
+}
+
+/*! \brief
+ * Make room for at least 'n' entries in the heap.
+ */
+static int sched_heap_reserve(struct scheduler_context *c, unsigned int n)
+{
+    struct scheduler **q;
+    unsigned int max = c->schedqmax;
+
+    if (n <= max)
+        return 0;
+    while (max < n)
+        max *= 2;
+    if (!(q = SCHED_REALLOC(c->schedulerq, max * sizeof(*q))))
+        return -1;
+    sched_mem_charge(c, (long)(max - c->schedqmax) * (long)sizeof(*q));
+    c->schedulerq = q;
+    c->schedqmax = max;
+    return 0;
+}
+
+static int sched_heap_insert(struct scheduler_context *c, struct scheduler *s)
+{
+    if (sched_heap_reserve(c, c->schedsnt + 1))
+        return -1;
+
+    sched_heap_set(c, c->schedsnt++, s);
+    sched_heap_up(c, s->qindex);
+    return 0;
+}
+
+/*! \brief
+ * Restore the heap order of the whole array bottom-up, O(n).
+ * Used after many entries were appended without sifting.
+ */
+static void sched_heap_build(struct scheduler_context *c)
+{
+    unsigned int i;
+
+    if (c->schedsnt < 2)
+        return;
+    for (i = (c->schedsnt - 2) / SPD_SCHED_HEAP_ARITY + 1; i-- > 0; )
+        sched_heap_down(c, i);
+}
+
+/*! \brief
+ * Convert an absolute time into a wheel tick, rounding up so
+ * that an event is never expired before its time.
+ */
+static inline long long sched_wheel_tick(const struct sched_wheel *w, spd_ns_t t, int roundup)
+{
+    spd_ns_t ns = t - w->origin;
+
+    if (ns < 0)
+        return 0;
+    return roundup ? (ns + SPD_NS_PER_MS - 1) / SPD_NS_PER_MS : ns / SPD_NS_PER_MS;
+}
+
+static inline void sched_wheel_link(struct scheduler **head, struct scheduler *s)
+{
+    if ((s->wheel_next = *head))
+        (*head)->wheel_pprev = &s->wheel_next;
+    *head = s;
+    s->wheel_pprev = head;
+}
+
+static inline void sched_wheel_unlink(struct sched_wheel *w, struct scheduler *s)
+{
+    if (s->qindex == SPD_SCHED_WHEEL_DUE) {
+        if (!s->wheel_next)
+            w->duetail = s->wheel_pprev;
+    } else {
+        w->pending--;
+    }
+    if ((*s->wheel_pprev = s->wheel_next))
+        s->wheel_next->wheel_pprev = s->wheel_pprev;
+    s->wheel_next = NULL;
+    s->wheel_pprev = NULL;
+}
+
+/*! \brief
+ * Hash an event into the slot of the innermost wheel that
+ * still covers its distance from the current tick.
+ */
+static void sched_wheel_place(struct sched_wheel *w, struct scheduler *s)
+{
+    long long expires = sched_wheel_tick(w, s->when, 1);
+    long long idx = expires - w->tick;
+    unsigned int slot;
+    int level;
+
+    if (idx < 0) {
+        /* already late, expire it on the next advance */
+        slot = w->tick & (SPD_SCHED_WHEEL_SIZE0 - 1);
+    } else if (idx < SPD_SCHED_WHEEL_SIZE0) {
+        slot = expires & (SPD_SCHED_WHEEL_SIZE0 - 1);
+    } else {
+        if (idx > SPD_SCHED_WHEEL_MAXSPAN)
+            expires = w->tick + SPD_SCHED_WHEEL_MAXSPAN;
+        for (level = 1; level < SPD_SCHED_WHEEL_OUTER; level++) {
+            if (idx < 1LL << (SPD_SCHED_WHEEL_BITS0 + level * SPD_SCHED_WHEEL_BITS))
+                break;
+        }
+        slot = SPD_SCHED_WHEEL_SIZE0 + (level - 1) * SPD_SCHED_WHEEL_SIZE +
+            ((expires >> (SPD_SCHED_WHEEL_BITS0 + (level - 1) * SPD_SCHED_WHEEL_BITS)) & (SPD_SCHED_WHEEL_SIZE - 1));
+    }
+
+    s->qindex = slot;
+    sched_wheel_link(&w->slots[slot], s);
+    w->pending++;
+}
+
+static inline void sched_wheel_expire(struct sched_wheel *w, struct scheduler *s)
+{
+    s->qindex = SPD_SCHED_WHEEL_DUE;
+    sched_wheel_link(w->duetail, s);
+    w->duetail = &s->wheel_next;
+}
+
+/*! \brief
+ * Re-hash every event of an outer wheel slot into the wheels below it.
+ * \return the index of the slot, zero means the next outer wheel turns too.
+ */
+static unsigned int sched_wheel_cascade(struct sched_wheel *w, int level)
+{
+    unsigned int index = (w->tick >> (SPD_SCHED_WHEEL_BITS0 + (level - 1) * SPD_SCHED_WHEEL_BITS)) & (SPD_SCHED_WHEEL_SIZE - 1);
+    struct scheduler **head = &w->slots[SPD_SCHED_WHEEL_SIZE0 + (level - 1) * SPD_SCHED_WHEEL_SIZE + index];
+    struct scheduler *s;
+
+    while ((s = *head)) {
+        sched_wheel_unlink(w, s);
+        sched_wheel_place(w, s);
+    }
+    return index;
+}
+
+/*! \brief
+ * Turn the wheel up to and including tick 'limit', moving every
+ * expired event onto the due list.
+ */
+static void sched_wheel_advance(struct sched_wheel *w, long long limit)
+{
+    struct scheduler **head;
+    struct scheduler *s;
+    unsigned int index;
+    int level;
+
+    while (w->tick <= limit) {
+        if (!w->pending) {
+            /* nothing left in the slots, no need to turn them one by one */
+            w->tick = limit + 1;
+            break;
+        }
+        index = w->tick & (SPD_SCHED_WHEEL_SIZE0 - 1);
+        for (level = 1; !index && level <= SPD_SCHED_WHEEL_OUTER; level++) {
+            if (sched_wheel_cascade(w, level))
+                break;
+        }
+        head = &w->slots[index];
+        while ((s = *head)) {
+            sched_wheel_unlink(w, s);
+            sched_wheel_expire(w, s);
+        }
+        w->tick++;
+    }
+}
+
+static struct scheduler *sched_wheel_min(struct scheduler *s, struct scheduler *best)
+{
+    for (; s; s = s->wheel_next) {
+        if (!best || s->when < best->when)
+            best = s;
+    }
+    return best;
+}
+
+/*! \brief
+ * Find the soonest event in the wheel. Only the first busy slot
+ * of each wheel (and the current slot of the outer ones, which may
+ * not be cascaded yet) can hold it. An outer event can be due before
+ * everything in the inner wheel, so every wheel is looked at and the
+ * earliest of their candidates wins.
+ */
+static struct scheduler *sched_wheel_first(const struct sched_wheel *w)
+{
+    struct scheduler *best = NULL;
+    const struct scheduler * const *slots;
+    unsigned int i, cur, shift;
+    int level;
+
+    if (w->due)
+        return w->due;
+    if (!w->pending)
+        return NULL;
+
+    cur = w->tick & (SPD_SCHED_WHEEL_SIZE0 - 1);
+    for (i = 0; i < SPD_SCHED_WHEEL_SIZE0; i++) {
+        if (w->slots[(cur + i) & (SPD_SCHED_WHEEL_SIZE0 - 1)]) {
+            best = sched_wheel_min(w->slots[(cur + i) & (SPD_SCHED_WHEEL_SIZE0 - 1)], NULL);
+            break;
+        }
+    }
+
+    for (level = 1; level <= SPD_SCHED_WHEEL_OUTER; level++) {
+        slots = (const struct scheduler * const *)&w->slots[SPD_SCHED_WHEEL_SIZE0 + (level - 1) * SPD_SCHED_WHEEL_SIZE];
+        shift = SPD_SCHED_WHEEL_BITS0 + (level - 1) * SPD_SCHED_WHEEL_BITS;
+        cur = (w->tick >> shift) & (SPD_SCHED_WHEEL_SIZE - 1);
+        best = sched_wheel_min((struct scheduler *)slots[cur], best);
+        for (i = 1; i < SPD_SCHED_WHEEL_SIZE; i++) {
+            if (slots[(cur + i) & (SPD_SCHED_WHEEL_SIZE - 1)]) {
+                best = sched_wheel_min((struct scheduler *)slots[(cur + i) & (SPD_SCHED_WHEEL_SIZE - 1)], best);
+                break;
+            }
+        }
+    }
+    return best;
+}
+
+/*! \brief
+ * Take a sched structure and put it in the
+ * queue, such that the soonest event is
+ * first in the queue.
+ * \return 0 on success, -1 if the queue could not grow.
+ */
+static int add_scheduler(struct scheduler_context *c, struct scheduler *s)
+{
+    if (!s) {
+        return -1;
+    }
+
+    if (c->qtype == SPD_SCHED_QUEUE_WHEEL) {
+        sched_wheel_place(c->wheel, s);
+        c->schedsnt++;
+    } else if (sched_heap_insert(c, s)) {
+        return -1;
+    }
+    if (c->schedsnt > c->stats.depthmax)
+        c->stats.depthmax = c->schedsnt;
+    return 0;
+}
+
+/*! \brief
+ * Whether 'n' events about to be added should be appended to the heap
+ * unsorted and ordered afterwards by sched_queue_bulk_end(). That pays
+ * off once the batch is as large as the heap. Room is reserved if so.
+ */
+static int sched_queue_bulk_begin(struct scheduler_context *c, unsigned int n)
+{
+    return c->qtype == SPD_SCHED_QUEUE_HEAP && n > 1 && n >= c->schedsnt
+        && !sched_heap_reserve(c, c->schedsnt + n);
+}
+
+/*! \brief
+ * add_scheduler() for an event of a batch opened by sched_queue_bulk_begin().
+ */
+static int sched_queue_bulk_add(struct scheduler_context *c, struct scheduler *s, int bulk)
+{
+    if (!bulk)
+        return add_scheduler(c, s);
+    sched_heap_set(c, c->schedsnt++, s);
+    return 0;
+}
+
+static void sched_queue_bulk_end(struct scheduler_context *c, int bulk)
+{
+    if (bulk)
+        sched_heap_build(c);
+    if (c->schedsnt > c->stats.depthmax)
+        c->stats.depthmax = c->schedsnt;
+}
+
+/*! \brief
+ * Take a queued sched structure out of the queue.
+ */
+static void sched_queue_remove(struct scheduler_context *c, struct scheduler *s)
+{
+    if (c->qtype == SPD_SCHED_QUEUE_WHEEL) {
+        sched_wheel_unlink(c->wheel, s);
+        c->schedsnt--;
+        return;
+    }
+    sched_heap_remove(c, s->qindex);
+}
+
+/*! \brief
+ * Give a queued event a new due time where it is: a sift up or down
+ * the heap, or a move to another slot of the wheel.
+ */
+static void sched_queue_move(struct scheduler_context *c, struct scheduler *s, spd_ns_t when)
+{
+    spd_ns_t old = s->when;
+
+    s->when = when;
+    if (c->qtype == SPD_SCHED_QUEUE_WHEEL) {
+        sched_wheel_unlink(c->wheel, s);
+        sched_wheel_place(c->wheel, s);
+    } else if (when < old) {
+        sched_heap_up(c, s->qindex);
+    } else {
+        sched_heap_down(c, s->qindex);
+    }
+}
+
+/*! \brief
+ * The soonest event of the queue, NULL if it is empty.
+ */
+static struct scheduler *sched_queue_first(const struct scheduler_context *c)
+{
+    if (!c->schedsnt)
+        return NULL;
+    if (c->qtype == SPD_SCHED_QUEUE_WHEEL)
+        return sched_wheel_first(c->wheel);
+    return c->schedulerq[0];
+}
+
+/*! \brief
+ * Remove and return an event which should take place before
+ * 'limit', NULL if there is none.
+ */
+static struct scheduler *sched_queue_pop(struct scheduler_context *c, spd_ns_t limit)
+{
+    struct scheduler *s;
+
+    if (!c->schedsnt)
+        return NULL;
+    if (c->qtype == SPD_SCHED_QUEUE_WHEEL) {
+        sched_wheel_advance(c->wheel, sched_wheel_tick(c->wheel, limit, 0));
+        if ((s = c->wheel->due)) {
+            sched_wheel_unlink(c->wheel, s);
+            c->schedsnt--;
+        }
+        return s;
+    }
+    if (c->schedulerq[0]->when >= limit)
+        return NULL;
+    s = c->schedulerq[0];
+    sched_heap_remove(c, 0);
+    return s;
+}
+
+/*! \brief
+ * Call fn on every queued event, in no particular order, until it
+ * returns non-zero. fn may free the event it is given.
+ * \return the event fn stopped at, NULL if it never did.
+ */
+static struct scheduler *sched_queue_walk(const struct scheduler_context *c,
+    int (*fn)(struct scheduler *s, void *arg), void *arg)
+{
+    struct scheduler *s, *next;
+    unsigned int i;
+
+    if (c->qtype != SPD_SCHED_QUEUE_WHEEL) {
+        for (i = c->schedsnt; i > 0; i--) {
+            if (fn(c->schedulerq[i - 1], arg))
+                return c->schedulerq[i - 1];
+        }
+        return NULL;
+    }
+
+    for (s = c->wheel->due; s; s = next) {
+        next = s->wheel_next;
+        if (fn(s, arg))
+            return s;
+    }
+    for (i = 0; i < SPD_SCHED_WHEEL_SLOTS; i++) {
+        for (s = c->wheel->slots[i]; s; s = next) {
+            next = s->wheel_next;
+            if (fn(s, arg))
+                return s;
+        }
+    }
+    return NULL;
+}
+
+/*! \brief
+ * Push an event on the inbox. Wait-free, any thread may call it.
+ * \note The inbox is an intrusive multi-producer single-consumer
+ * queue: producers swap themselves in as the newest node and then
+ * link the previous one to them. The consumer is whoever holds
+ * the context lock.
+ */
+static void sched_inbox_push(struct scheduler_context *c, struct scheduler *s)
+{
+    struct scheduler *prev;
+
+    __atomic_store_n(&s->inbox_next, NULL, __ATOMIC_RELAXED);
+    prev = __atomic_exchange_n(&c->inhead, s, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&prev->inbox_next, s, __ATOMIC_RELEASE);
+}
+
+/*! \brief
+ * Take the oldest event off the inbox, NULL if it is empty.
+ * Must be called with the context locked.
+ */
+static struct scheduler *sched_inbox_pop(struct scheduler_context *c)
+{
+    struct scheduler *tail, *next;
+
+    for (;;) {
+        tail = c->intail;
+        next = __atomic_load_n(&tail->inbox_next, __ATOMIC_ACQUIRE);
+        if (tail == &c->instub) {
+            if (!next) {
+                if (__atomic_load_n(&c->inhead, __ATOMIC_ACQUIRE) == tail)
+                    return NULL;
+                /* a producer swapped the head in but did not link it yet */
+                sched_yield();
+                continue;
+            }
+            c->intail = tail = next;
+            next = __atomic_load_n(&tail->inbox_next, __ATOMIC_ACQUIRE);
+        }
+        if (next) {
+            c->intail = next;
+            return tail;
+        }
+        if (__atomic_load_n(&c->inhead, __ATOMIC_ACQUIRE) == tail) {
+            /* tail is the last node, put the stub behind it so it can be taken */
+            sched_inbox_push(c, &c->instub);
+            if ((next = __atomic_load_n(&tail->inbox_next, __ATOMIC_ACQUIRE))) {
+                c->intail = next;
+                return tail;
+            }
+        }
+        sched_yield();
+    }
+}
+
+/*! \brief
+ * Move the events pushed by lock-free producers into the queue.
+ * Must be called with the context locked.
+ * \return the number of events moved
+ */
+static int sched_inbox_drain(struct scheduler_context *c)
+{
+    struct scheduler *s;
+    int n = 0;
+
+    if (!c->lockfree)
+        return 0;
+    while ((s = sched_inbox_pop(c))) {
+        if (sched_index_add(c, s) || add_scheduler(c, s)) {
+            spd_log(LOG_WARNING, "dropping event %d, out of memory\n", s->id);
+            scheduler_release(c, s);
+            continue;
+        }
+        s->state = SCHED_QUEUED;
+        n++;
+    }
+    return n;
+}
+
+/*! \brief
+ * Lock the context and bring the queue up to date with the inbox.
+ */
+static void sched_lock(struct scheduler_context *c)
+{
+    sched_mutex_lock(c);
+    sched_inbox_drain(c);
+}
+
+/*! \brief
+ * Sleep on the context condition until 'deadline', or until an event
+ * due before it is added. The lock is released while sleeping.
+ * Lock-free producers only signal when someone is waiting, so
+ * announce ourselves first and look at the inbox once more.
+ */
+static void sched_cond_sleep(struct scheduler_context *c, spd_ns_t deadline)
+{
+    struct timespec ts;
+
+    /* with several sleepers keep the latest wake-up, a wake too many is harmless */
+    if (!__atomic_load_n(&c->waiting, __ATOMIC_RELAXED) || deadline > c->waketime)
+        __atomic_store_n(&c->waketime, deadline, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&c->waiting, 1, __ATOMIC_SEQ_CST);
+    if (!sched_inbox_drain(c)) {
+        sched_stat_add(&c->stats.wakeups, 1);
+        sched_lock_released(c);
+        if (deadline == SPD_SCHED_NEVER) {
+            pthread_cond_wait(&c->cond, &c->lock);
+        } else {
+            ts = spd_ns2ts(deadline);
+            pthread_cond_timedwait(&c->cond, &c->lock, &ts);
+        }
+        sched_lock_acquired(c, 0);
+    }
+    __atomic_sub_fetch(&c->waiting, 1, __ATOMIC_RELAXED);
+    sched_inbox_drain(c);
+}
+
+/*! \brief
+ * Whether an event due at 'when' must wake a sleeping dispatcher,
+ * that is whether it is due before the dispatcher wakes up by itself.
+ */
+static inline int sched_need_wake(struct scheduler_context *c, spd_ns_t when)
+{
+    return __atomic_load_n(&c->waiting, __ATOMIC_SEQ_CST)
+        && when < __atomic_load_n(&c->waketime, __ATOMIC_RELAXED);
+}
+
+/*! \brief
+ * Arm the timerfd for the absolute monotonic time 'when', or disarm it
+ * for SPD_SCHED_NEVER. Must be called with the context locked.
+ */
+static void sched_timerfd_set(struct scheduler_context *c, spd_ns_t when)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    if (when != SPD_SCHED_NEVER)
+        its.it_value = spd_ns2ts(when > 0 ? when : 1);   /* all zero would disarm it */
+    if (timerfd_settime(c->timerfd, TFD_TIMER_ABSTIME, &its, NULL)) {
+        spd_log(LOG_WARNING, "failed to arm the scheduler timerfd\n");
+        return;
+    }
+    __atomic_store_n(&c->timerarmed, when, __ATOMIC_RELAXED);
+}
+
+/*! \brief
+ * An event due at 'when' was queued: wake the dispatcher or pull the
+ * timerfd in if it is due before they would notice on their own.
+ * Must be called with the context locked.
+ */
+static void sched_wake(struct scheduler_context *c, spd_ns_t when)
+{
+    if (sched_need_wake(c, when)) {
+#ifdef USE_COND_WAIT
+        pthread_cond_signal(&c->cond);
+#endif
+        /* spd_sched_loop_run() sleeps in epoll_wait */
+        if (c->evfd >= 0)
+            eventfd_write(c->evfd, 1);
+    }
+    if (c->timerfd >= 0 && when < c->timerarmed)
+        sched_timerfd_set(c, when);
+#ifdef USE_IO_URING
+    if (sched_uring_wake_needed(c, when))
+        sched_uring_wake(c, when);
+#endif
+}
+
+/*! \brief
+ * Clear the timerfd and arm it for the first event.
+ * Must be called with the context locked.
+ */
+static void sched_timerfd_rearm(struct scheduler_context *c)
+{
+    struct scheduler *first;
+    uint64_t expirations;
+
+    if (c->timerfd < 0)
+        return;
+    /* nonblocking, only resets the readable state */
+    if (read(c->timerfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+        spd_log(LOG_WARNING, "failed to read the scheduler timerfd: %s\n", strerror(errno));
+    first = sched_queue_first(c);
+    sched_timerfd_set(c, first ? first->when : SPD_SCHED_NEVER);
+}
+
+/*! \brief
+ * Create the timerfd of the context unless it has one, armed for the
+ * first event. Must be called with the context locked.
+ * \return the descriptor, -1 on failure.
+ */
+static int sched_timerfd_init(struct scheduler_context *c)
+{
+    int fd;
+
+    if ((fd = c->timerfd) < 0) {
+        if ((fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+            spd_log(LOG_WARNING, "timerfd_create failed: %s\n", strerror(errno));
+        } else {
+            c->timerfd = fd;
+            sched_timerfd_rearm(c);
+        }
+    }
+    return fd;
+}
+
+int spd_sched_get_fd(struct scheduler_context *c)
+{
+    int fd;
+
+    sched_lock(c);
+    fd = sched_timerfd_init(c);
+    sched_mutex_unlock(c);
+
+    return fd;
+}
+
+int spd_sched_set_lockfree(struct scheduler_context *c, int enable)
+{
+    sched_mutex_lock(c);
+    sched_inbox_drain(c);
+    c->lockfree = enable ? 1 : 0;
+    sched_mutex_unlock(c);
+    return 0;
+}
+
+#ifdef USE_IO_URING
+/*! \brief Ring used by spd_sched_uring_wait()
+ * \note Only timeouts go through it: one IORING_OP_TIMEOUT for the
+ * first event at a time, moved with IORING_TIMEOUT_UPDATE. The
+ * submission queue is only filled under the context lock, so a
+ * producer that queues an earlier event updates the timeout of the
+ * waiting loop itself instead of signalling it. A producer enters
+ * the ring before it unlocks; the loop enters it after unlocking,
+ * submitting its timeout and waiting in the same system call.
+ * Updates are sent with IOSQE_CQE_SKIP_SUCCESS where the kernel has
+ * it, so only the timeout itself completes and wakes the loop. Older
+ * kernels complete every update too; the loop reaps those and goes
+ * back to sleep without returning.
+ */
+struct sched_uring {
+    int fd;
+    unsigned int *sqhead;
+    unsigned int *sqtail;
+    unsigned int *sqarray;
+    unsigned int sqmask;
+    struct io_uring_sqe *sqes;
+    unsigned int *cqhead;
+    unsigned int *cqtail;
+    unsigned int cqmask;
+    struct io_uring_cqe *cqes;
+    void *sqmap;
+    size_t sqmapsz;
+    void *cqmap;
+    size_t cqmapsz;
+    size_t sqesz;
+    struct __kernel_timespec ts;    /*!< Expiry read by the pending IORING_OP_TIMEOUT */
+    struct __kernel_timespec uts;   /*!< Expiry read by the pending timeout update */
+    spd_ns_t armed;                 /*!< Expiry of the timeout, SPD_SCHED_NEVER if none is pending */
+    int waiting;                    /*!< The loop is blocked in io_uring_enter() */
+    unsigned char skip;             /*!< IOSQE_CQE_SKIP_SUCCESS if the kernel supports it, else 0 */
+};
+
+#define SPD_SCHED_URING_ENTRIES 16
+
+/*! \brief user_data of the requests sent to the ring */
+enum sched_uring_op {
+    SCHED_URING_TIMEOUT = 1,
+    SCHED_URING_UPDATE,
+};
+
+static void sched_uring_destroy(struct sched_uring *u)
+{
+    if (!u)
+        return;
+    if (u->sqes)
+        munmap(u->sqes, u->sqesz);
+    if (u->cqmap && u->cqmap != u->sqmap)
+        munmap(u->cqmap, u->cqmapsz);
+    if (u->sqmap)
+        munmap(u->sqmap, u->sqmapsz);
+    close(u->fd);
+    SAFE_FREE(u);
+}
+
+static struct sched_uring *sched_uring_create(void)
+{
+    struct io_uring_params p;
+    struct sched_uring *u;
+    char *sq, *cq;
+
+    if (!(u = SCHED_CALLOC(1, sizeof(*u))))
+        return NULL;
+    memset(&p, 0, sizeof(p));
+    if ((u->fd = syscall(__NR_io_uring_setup, SPD_SCHED_URING_ENTRIES, &p)) < 0) {
+        spd_log(LOG_WARNING, "io_uring_setup failed: %s\n", strerror(errno));
+        SAFE_FREE(u);
+        return NULL;
+    }
+    u->armed = SPD_SCHED_NEVER;
+    u->skip = p.features & IORING_FEAT_CQE_SKIP ? IOSQE_CQE_SKIP_SUCCESS : 0;
+
+    u->sqmapsz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    u->cqmapsz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cqmapsz > u->sqmapsz)
+            u->sqmapsz = u->cqmapsz;
+        u->cqmapsz = u->sqmapsz;
+    }
+    u->sqmap = mmap(NULL, u->sqmapsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sqmap == MAP_FAILED) {
+        u->sqmap = NULL;
+        goto fail;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        u->cqmap = u->sqmap;
+    } else {
+        u->cqmap = mmap(NULL, u->cqmapsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if (u->cqmap == MAP_FAILED) {
+            u->cqmap = NULL;
+            goto fail;
+        }
+    }
+    u->sqesz = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqesz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        u->sqes = NULL;
+        goto fail;
+    }
+
+    sq = u->sqmap;
+    cq = u->cqmap;
+    u->sqhead = (unsigned int *)(sq + p.sq_off.head);
+    u->sqtail = (unsigned int *)(sq + p.sq_off.tail);
+    u->sqmask = *(unsigned int *)(sq + p.sq_off.ring_mask);
+    u->sqarray = (unsigned int *)(sq + p.sq_off.array);
+    u->cqhead = (unsigned int *)(cq + p.cq_off.head);
+    u->cqtail = (unsigned int *)(cq + p.cq_off.tail);
+    u->cqmask = *(unsigned int *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return u;
+
+fail:
+    spd_log(LOG_WARNING, "failed to map the io_uring: %s\n", strerror(errno));
+    sched_uring_destroy(u);
+    return NULL;
+}
+
+/*! \brief
+ * Queue a request setting the timeout to 'when': a new timeout if
+ * none is pending, an update of the pending one otherwise. The
+ * request still has to be submitted with io_uring_enter().
+ * Must be called with the context locked.
+ * \return 0 if a request was queued, -1 if the queue is full.
+ */
+static int sched_uring_arm(struct sched_uring *u, spd_ns_t when)
+{
+    struct io_uring_sqe *sqe;
+    struct __kernel_timespec *ts;
+    unsigned int tail = *u->sqtail;
+    unsigned int i = tail & u->sqmask;
+
+    if (tail - __atomic_load_n(u->sqhead, __ATOMIC_ACQUIRE) > u->sqmask)
+        return -1;
+    sqe = &u->sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = -1;
+    if (u->armed == SPD_SCHED_NEVER) {
+        ts = &u->ts;
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->len = 1;
+        sqe->timeout_flags = IORING_TIMEOUT_ABS;
+        sqe->user_data = SCHED_URING_TIMEOUT;
+    } else {
+        ts = &u->uts;
+        sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+        sqe->addr = SCHED_URING_TIMEOUT;
+        sqe->timeout_flags = IORING_TIMEOUT_UPDATE | IORING_TIMEOUT_ABS;
+        sqe->user_data = SCHED_URING_UPDATE;
+        /* a successful update must not wake the loop, the moved timeout will */
+        sqe->flags = u->skip;
+    }
+    ts->tv_sec = when / SPD_NS_PER_SEC;
+    ts->tv_nsec = when % SPD_NS_PER_SEC;
+    if (sqe->opcode == IORING_OP_TIMEOUT)
+        sqe->addr = (unsigned long)ts;
+    else
+        sqe->addr2 = (unsigned long)ts;
+    u->sqarray[i] = i;
+    __atomic_store_n(u->sqtail, tail + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&u->armed, when, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/*! \brief
+ * Consume the completions. Must be called with the context locked.
+ */
+static void sched_uring_reap(struct sched_uring *u)
+{
+    unsigned int head = *u->cqhead;
+    struct io_uring_cqe *cqe;
+
+    for (; head != __atomic_load_n(u->cqtail, __ATOMIC_ACQUIRE); head++) {
+        cqe = &u->cqes[head & u->cqmask];
+        /* the timeout expired, there is at most one pending */
+        if (cqe->user_data == SCHED_URING_TIMEOUT)
+            __atomic_store_n(&u->armed, SPD_SCHED_NEVER, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(u->cqhead, head, __ATOMIC_RELEASE);
+}
+
+/*! \brief
+ * Whether an event due at 'when' is earlier than a loop waiting in
+ * spd_sched_uring_wait() would wake up.
+ */
+static int sched_uring_wake_needed(struct scheduler_context *c, spd_ns_t when)
+{
+    struct sched_uring *u = __atomic_load_n(&c->uring, __ATOMIC_ACQUIRE);
+
+    return u && __atomic_load_n(&u->waiting, __ATOMIC_SEQ_CST)
+        && when < __atomic_load_n(&u->armed, __ATOMIC_RELAXED);
+}
+
+/*! \brief
+ * Pull the timeout of the waiting loop in to 'when'.
+ * Must be called with the context locked.
+ */
+static void sched_uring_wake(struct scheduler_context *c, spd_ns_t when)
+{
+    if (sched_uring_arm(c->uring, when)) {
+        spd_log(LOG_WARNING, "io_uring submission queue is full\n");
+        return;
+    }
+    if (syscall(__NR_io_uring_enter, c->uring->fd, 1, 0, 0, NULL, 0) < 0)
+        spd_log(LOG_WARNING, "io_uring_enter failed: %s\n", strerror(errno));
+}
+
+int spd_sched_uring_wait(struct scheduler_context *c)
+{
+    struct sched_uring *u;
+    struct scheduler *first;
+    spd_ns_t deadline;
+    unsigned int submit;
+
+    sched_lock(c);
+    if (!(u = c->uring)) {
+        if (!(u = sched_uring_create())) {
+            sched_mutex_unlock(c);
+            return -1;
+        }
+        __atomic_store_n(&c->uring, u, __ATOMIC_RELEASE);
+    }
+    for (;;) {
+        sched_uring_reap(u);
+        first = sched_queue_first(c);
+        if (first && first->when <= spd_nsnow())
+            break;
+        /* an early timeout left from a deleted event is not chased, it only costs a wakeup */
+        deadline = first ? first->when : SPD_SCHED_NEVER;
+        submit = deadline != SPD_SCHED_NEVER && deadline != u->armed && !sched_uring_arm(u, deadline);
+        __atomic_store_n(&u->waiting, 1, __ATOMIC_SEQ_CST);
+        if (sched_inbox_drain(c)) {
+            /* a lock-free add came in after the queue was looked at */
+            __atomic_store_n(&u->waiting, 0, __ATOMIC_RELAXED);
+            if (submit && syscall(__NR_io_uring_enter, u->fd, 1, 0, 0, NULL, 0) < 0)
+                spd_log(LOG_WARNING, "io_uring_enter failed: %s\n", strerror(errno));
+            continue;
+        }
+        sched_mutex_unlock(c);
+
+        sched_stat_add(&c->stats.wakeups, 1);
+        if (syscall(__NR_io_uring_enter, u->fd, submit, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0
+            && errno != EINTR)
+            spd_log(LOG_WARNING, "io_uring_enter failed: %s\n", strerror(errno));
+
+        sched_lock(c);
+        __atomic_store_n(&u->waiting, 0, __ATOMIC_RELAXED);
+    }
+    sched_mutex_unlock(c);
+
+    return 0;
+}
+#endif /* USE_IO_URING */
+
+/*! \brief
+ * Set up the epoll instance of spd_sched_loop_run(), the eventfd other
+ * threads use to wake it and the context timerfd, which wakes it for
+ * the first event with the precision of the event's time rather than
+ * the milliseconds of an epoll_wait() timeout.
+ * Must be called with the context locked.
+ */
+static int sched_reactor_init(struct scheduler_context *c)
+{
+    struct epoll_event ev;
+
+    if (c->epfd >= 0)
+        return 0;
+    if ((c->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        spd_log(LOG_WARNING, "epoll_create1 failed: %s\n", strerror(errno));
+        return -1;
+    }
+    if ((c->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        spd_log(LOG_WARNING, "eventfd failed: %s\n", strerror(errno));
+        close(c->epfd);
+        c->epfd = -1;
+        return -1;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = c->evfd;
+    if (epoll_ctl(c->epfd, EPOLL_CTL_ADD, c->evfd, &ev)) {
+        spd_log(LOG_WARNING, "epoll_ctl failed: %s\n", strerror(errno));
+        goto fail;
+    }
+    /* the timerfd stays with the context on failure, spd_sche_context_destroy() closes it */
+    if ((ev.data.fd = sched_timerfd_init(c)) < 0)
+        goto fail;
+    if (epoll_ctl(c->epfd, EPOLL_CTL_ADD, c->timerfd, &ev)) {
+        spd_log(LOG_WARNING, "epoll_ctl failed: %s\n", strerror(errno));
+        goto fail;
+    }
+    return 0;
+
+fail:
+    close(c->evfd);
+    close(c->epfd);
+    c->epfd = c->evfd = -1;
+    return -1;
+}
+
+int spd_sched_add_fd(struct scheduler_context *c, int fd, int events, spd_sched_fd_cb callback, void *data)
+{
+    struct sched_fd *tab;
+    struct epoll_event ev;
+    unsigned int max;
+    int res = -1;
+
+    if (fd < 0 || !callback)
+        return -1;
+
+    sched_lock(c);
+    if (sched_reactor_init(c))
+        goto done;
+    if ((unsigned int)fd >= c->fdmax) {
+        for (max = c->fdmax ? c->fdmax : SPD_SCHED_FD_INITIAL; max <= (unsigned int)fd; max *= 2)
+            ;
+        if (!(tab = SCHED_REALLOC(c->fdtab, max * sizeof(*tab))))
+            goto done;
+        memset(tab + c->fdmax, 0, (max - c->fdmax) * sizeof(*tab));
+        sched_mem_charge(c, (long)(max - c->fdmax) * (long)sizeof(*tab));
+        c->fdtab = tab;
+        c->fdmax = max;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(c->epfd, c->fdtab[fd].callback ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev)) {
+        spd_log(LOG_WARNING, "epoll_ctl on fd %d failed: %s\n", fd, strerror(errno));
+        goto done;
+    }
+    c->fdtab[fd].callback = callback;
+    c->fdtab[fd].data = data;
+    c->fdtab[fd].events = events;
+    res = 0;
+
+done:
+    sched_mutex_unlock(c);
+    return res;
+}
+
+/*! \brief
+ * Stop watching fd. Must be called with the context locked.
+ */
+static int sched_del_fd(struct scheduler_context *c, int fd)
+{
+    if (fd < 0 || (unsigned int)fd >= c->fdmax || !c->fdtab[fd].callback)
+        return -1;
+    c->fdtab[fd].callback = NULL;
+    c->fdtab[fd].data = NULL;
+    /* fails harmlessly if fd was closed already, which drops it from epoll */
+    epoll_ctl(c->epfd, EPOLL_CTL_DEL, fd, NULL);
+    return 0;
+}
+
+int spd_sched_del_fd(struct scheduler_context *c, int fd)
+{
+    int res;
+
+    sched_lock(c);
+    res = sched_del_fd(c, fd);
+    sched_mutex_unlock(c);
+
+    return res;
+}
+
+/*! \brief
+ * Run the callbacks of the descriptors epoll_wait() reported.
+ * The registrations are copied in one lock hold, so a callback may add
+ * or delete descriptors and timers.
+ */
+static void sched_loop_dispatch(struct scheduler_context *c, struct epoll_event *evs, int n)
+{
+    struct sched_fd fds[SPD_SCHED_LOOP_EVENTS];
+    eventfd_t v;
+    int i, fd;
+
+    sched_lock(c);
+    for (i = 0; i < n; i++) {
+        fd = evs[i].data.fd;
+        if (fd == c->evfd) {
+            eventfd_read(c->evfd, &v);
+            fds[i].callback = NULL;
+        } else if (fd == c->timerfd) {
+            /* the next spd_sched_runall() clears it */
+            fds[i].callback = NULL;
+        } else if ((unsigned int)fd < c->fdmax) {
+            fds[i] = c->fdtab[fd];
+        } else {
+            fds[i].callback = NULL;
+        }
+    }
+    sched_mutex_unlock(c);
+
+    for (i = 0; i < n; i++) {
+        if (fds[i].callback && !fds[i].callback(evs[i].data.fd, evs[i].events, fds[i].data)) {
+            sched_lock(c);
+            /* unless the callback already replaced itself */
+            if (c->fdtab[evs[i].data.fd].callback == fds[i].callback && c->fdtab[evs[i].data.fd].data == fds[i].data)
+                sched_del_fd(c, evs[i].data.fd);
+            sched_mutex_unlock(c);
+        }
+    }
+}
+
+int spd_sched_loop_run(struct scheduler_context *c)
+{
+    struct epoll_event evs[SPD_SCHED_LOOP_EVENTS];
+    struct scheduler *first;
+    int n, timeout;
+
+    sched_lock(c);
+    if (sched_reactor_init(c)) {
+        sched_mutex_unlock(c);
+        return -1;
+    }
+    c->loopstop = 0;
+    sched_mutex_unlock(c);
+
+    for (;;) {
+        spd_sched_runall(c);
+
+        /*
+         * sleep until the first event like spd_sched_cond_wait(): the timerfd,
+         * which spd_sched_runall() armed for it, wakes us when it is due and
+         * other threads wake us through evfd
+         */
+        sched_lock(c);
+        if (c->loopstop) {
+            sched_mutex_unlock(c);
+            break;
+        }
+        first = sched_queue_first(c);
+        __atomic_store_n(&c->waketime, first ? first->when : SPD_SCHED_NEVER, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&c->waiting, 1, __ATOMIC_SEQ_CST);
+        if (sched_inbox_drain(c) || (first && first->when <= spd_nsnow()))
+            timeout = 0;
+        else
+            timeout = -1;
+        sched_mutex_unlock(c);
+
+        if (timeout)
+            sched_stat_add(&c->stats.wakeups, 1);
+        n = epoll_wait(c->epfd, evs, SPD_SCHED_LOOP_EVENTS, timeout);
+        __atomic_sub_fetch(&c->waiting, 1, __ATOMIC_RELAXED);
+        if (n < 0 && errno != EINTR) {
+            spd_log(LOG_WARNING, "epoll_wait failed: %s\n", strerror(errno));
+            return -1;
+        }
+        if (n > 0)
+            sched_loop_dispatch(c, evs, n);
+    }
+    return 0;
+}
+
+void spd_sched_loop_stop(struct scheduler_context *c)
+{
+    sched_lock(c);
+    c->loopstop = 1;
+    if (c->evfd >= 0)
+        eventfd_write(c->evfd, 1);
+    sched_mutex_unlock(c);
+}
+
+/* To support new scheduler inform when add a new scheduler. */
+#ifdef USE_COND_WAIT
+/*! \brief
+ * Wait until the first event is due. The lock is only held while
+ * looking at the queue: the sleep itself is a timed wait on the
+ * condition until the absolute monotonic time of the first event,
+ * cut short when an earlier event is added.
+ */
+int spd_sched_cond_wait(struct scheduler_context * c)
+{
+    struct scheduler *first;
+    int res = 0;
+
+    sched_lock(c);
+    for (;;) {
+        if (c->stop) {
+            res = -1;
+            break;
+        }
+        if (!(first = sched_queue_first(c))) {
+            sched_cond_sleep(c, SPD_SCHED_NEVER);
+        } else if (first->when > spd_nsnow()) {
+            sched_cond_sleep(c, first->when);
+        } else {
+            break;
+        }
+    }
+    sched_mutex_unlock(c);
+
+    return res;
+}
+
+#else
+/*! \brief
+ * Return the number of milliseconds 
+ * until the next scheduled event
+ */
+int spd_sched_wait(struct scheduler_context * c)
+{
+    int ms;
+    //DEBUG(spd_log(LOG_DEBUG, "ast_sched_wait()\n"));
+    //spd_log(LOG_DEBUG, "ast_sched_wait()\n");
+    sched_lock(c);
+    if(!c->schedsnt){
+        ms = -1;
+    } else {
+        ms = spd_nsdiff_ms(sched_queue_first(c)->when, spd_nsnow());
+        if(ms < 0)
+            ms = 0;
+    }
+    sched_mutex_unlock(c);
+
+    return ms;
+}
+#endif
+
+/*! \brief
+ * Move a due time up to 'slack' ms later, onto the instant of that
+ * window with the most trailing zero bits, as the kernel does for timer
+ * slack. Events whose windows overlap land on the same instant, so one
+ * wakeup of the dispatcher runs them all.
+ */
+static inline void sched_apply_slack(spd_ns_t *tv, unsigned int slack)
+{
+    uint64_t limit, mask;
+
+    if (!slack)
+        return;
+    limit = *tv + spd_ms2ns(slack);
+    if (!(mask = *tv ^ limit))
+        return;
+    mask = (1ULL << (63 - __builtin_clzll(mask))) - 1;
+    *tv = limit & ~mask;
+}
+
+/*! \brief
+ * computes the next time to schedule, 'tv' is the base time (usually is the time the last 
+ * event happended.) 'when' is the offset in milliseconds. if tv is 0, use the current 
+ * time as default. A non-zero 'slack' then moves it onto a shared instant.
+ *
+ * sched_settime always return 0 now.
+ */
+static int sched_settime_at(spd_ns_t *tv, int when, unsigned int slack, spd_ns_t now)
+{
+    if(!*tv)
+        *tv = now;
+    *tv += spd_ms2ns(when);
+    if(*tv < now) {
+        *tv = now;
+    }
+    sched_apply_slack(tv, slack);
+    return 0;
+}
+
+static int sched_settime(spd_ns_t *tv, int when, unsigned int slack)
+{
+    return sched_settime_at(tv, when, slack, spd_nsnow());
+}
+
+/*! \brief Default destructor, the data was allocated by the caller
+ * with plain malloc(), so it is freed past the allocation counters.
+ */
+static void sched_data_free(void *data)
+{
+    free(data);
+}
+
+/*! \brief
+ * Attach the data of a new event: a payload of len bytes is copied
+ * into the event, otherwise data is kept and released with destroy.
+ */
+static inline void sched_set_data(struct scheduler *s, void *data, size_t len, spd_sched_destroy_cb destroy)
+{
+    if (len) {
+        memcpy(s->payload, data, len);
+        s->data = s->payload;
+        s->destroy = NULL;
+    } else {
+        s->data = data;
+        s->destroy = destroy;
+    }
+}
+
+/*! \brief
+ * Add an event without taking the context lock: it is pushed on
+ * the inbox and moved into the queue by the next thread that locks
+ * the context. Only a sleeping dispatcher costs a lock round-trip,
+ * and the add that sees the id counter wrap first.
+ */
+static int sched_add_lockfree(struct scheduler_context * con, int when, unsigned int slack, spd_scheduler_cb callback, void* data,
+    size_t len, spd_sched_destroy_cb destroy, int flag, int retry_times)
+{
+    struct scheduler *tmp;
+    spd_ns_t due;
+    int id, wrapped = 0;
+
+    if (!(tmp = sched_alloc()))
+        return -1;
+    id = sched_alloc_id_wrapped(con, &wrapped);
+    if (wrapped) {
+        /* lost the race with the wrap: check the id with the inbox drained */
+        sched_lock(con);
+        while (sched_index_find(con, id))
+            id = sched_alloc_id(con);
+        sched_mutex_unlock(con);
+    }
+    tmp->id = id;
+    tmp->callback = callback;
+    sched_set_data(tmp, data, len, destroy);
+    tmp->reschedule = when;
+    tmp->flag = flag;
+    tmp->retry_times = retry_times ? retry_times : 1; /* retry_times is at least 1*/
+    tmp->slack = slack;
+    sched_settime(&tmp->when, when, slack);
+    due = tmp->when;
+
+    /* tmp belongs to the consumer from here on */
+    sched_inbox_push(con, tmp);
+    sched_stat_add(&con->stats.adds, 1);
+    if (sched_need_wake(con, due) || due < __atomic_load_n(&con->timerarmed, __ATOMIC_RELAXED)
+#ifdef USE_IO_URING
+        || sched_uring_wake_needed(con, due)
+#endif
+        ) {
+        /* drain so the event is queued before anyone looks at the queue again */
+        sched_lock(con);
+        sched_wake(con, due);
+        sched_mutex_unlock(con);
+    }
+    return id;
+}
+
+/*! \brief
+ * Schedule callback(data) to happen when ms into the future.
+ * The event gets a handle slot if 'handle' is given, an id otherwise.
+ * A non-zero 'len' copies the payload into the event, see sched_set_data().
+ * A non-zero 'slack' lets the event run up to that many ms late, see sched_apply_slack().
+ * \return the id, 0 for an event added by handle, -1 on failure
+ */
+static int sched_add(struct scheduler_context * con, int when, unsigned int slack, spd_scheduler_cb callback, void* data,
+    size_t len, spd_sched_destroy_cb destroy, int flag, int retry_times, spd_sched_handle_t *handle)
+{
+    struct scheduler *tmp;
+    spd_ns_t due = SPD_SCHED_NEVER;
+    int res = -1;
+
+    if (NULL == con)
+    {
+        spd_log(LOG_DEBUG, "scheduler context is NULL!");
+        return -1;
+    }
+    if(!flag && (!when || (when < 0))) {
+        spd_log(LOG_DEBUG," if flag is 0, rescheduled can't be 0 or smaller than 0 ! \n");
+        return -1;
+    }
+
+    /* once the id counter wraps only the index can tell a free id */
+    if (!handle && __atomic_load_n(&con->lockfree, __ATOMIC_RELAXED)
+        && !__atomic_load_n(&con->idwrapped, __ATOMIC_RELAXED))
+        return sched_add_lockfree(con, when, slack, callback, data, len, destroy, flag, retry_times);
+
+    sched_lock(con);
+    
+    if((tmp = sched_alloc())) {
+        tmp->id = handle ? 0 : sched_next_id(con);
+        tmp->slot = 0;
+        tmp->callback = callback;
+        sched_set_data(tmp, data, len, destroy);
+        tmp->reschedule = when;
+        tmp->flag = flag;
+        tmp->when = 0;
+        tmp->retry_times = retry_times ? retry_times : 1; /* retry_times is at least 1*/
+        tmp->slack = slack;
+        if(sched_settime(&tmp->when, when, slack)) {
+            scheduler_release(con, tmp);
+        } else {
+            if (handle ? !(*handle = sched_slot_add(con, tmp)) : sched_index_add(con, tmp)) {
+                scheduler_release(con, tmp);
+            } else if (add_scheduler(con, tmp)) {
+                scheduler_release(con, tmp);
+            } else {
+                tmp->state = SCHED_QUEUED;
+                res = tmp->id;
+                due = tmp->when;
+                sched_stat_add(&con->stats.adds, 1);
+                spd_log(LOG_DEBUG, "added event %d callback %p data %p in %dms (%d in Q)\n",
+                    tmp->id, tmp->callback, tmp->data, when, con->schedsnt);
+            }
+        }
+    }
+
+    sched_wake(con, due);
+    
+    sched_mutex_unlock(con);
+    
+    return res;
+}
+
+#if 0
+int spd_sched_add_flag(struct scheduler_context * con, int when, spd_scheduler_cb callback, void* data, int flag)
+#else
+int spd_sched_add_flag(struct scheduler_context * con, int when, spd_scheduler_cb callback, void* data, int flag, int retry_times)
+#endif
+{
+    return sched_add(con, when, 0, callback, data, 0, sched_data_free, flag, retry_times, NULL);
+}
+
+int spd_sched_add_inline(struct scheduler_context * con, int when, spd_scheduler_cb callback, const void *data, size_t len, int flag, int retry_times)
+{
+    if (len > SPD_SCHED_INLINE_DATA || (len && NULL == data)) {
+        spd_log(LOG_DEBUG, "inline payload of %zu bytes is invalid\n", len);
+        return -1;
+    }
+    return sched_add(con, when, 0, callback, (void *)data, len, NULL, flag, retry_times, NULL);
+}
+
+int spd_sched_add_destroy(struct scheduler_context * con, int when, spd_scheduler_cb callback, void *data, spd_sched_destroy_cb destroy, int flag, int retry_times)
+{
+    return sched_add(con, when, 0, callback, data, 0, destroy, flag, retry_times, NULL);
+}
+
+int spd_sched_add_slack(struct scheduler_context * con, int when, int slack, spd_scheduler_cb callback, void *data, int flag, int retry_times)
+{
+    if (slack < 0) {
+        spd_log(LOG_DEBUG, "slack can't be smaller than 0\n");
+        return -1;
+    }
+    return sched_add(con, when, slack, callback, data, 0, sched_data_free, flag, retry_times, NULL);
+}
+
+int spd_sched_add_periodic(struct scheduler_context * con, int when, int period, enum spd_sched_period mode,
+    enum spd_sched_catchup catchup, spd_sched_periodic_cb callback, void *data)
+{
+    struct scheduler *tmp;
+    spd_ns_t due = SPD_SCHED_NEVER;
+    int res = -1;
+
+    if (NULL == con || period <= 0 || when < 0
+        || (unsigned int)mode > SPD_SCHED_FIXED_DELAY || (unsigned int)catchup > SPD_SCHED_CATCHUP_BURST) {
+        spd_log(LOG_DEBUG, "invalid periodic event, period %d first run in %dms\n", period, when);
+        return -1;
+    }
+
+    /* always through the lock, like a handle, the inbox only carries plain events */
+    sched_lock(con);
+    if ((tmp = sched_alloc())) {
+        tmp->id = sched_next_id(con);
+        tmp->slot = 0;
+        tmp->tick = callback;
+        sched_set_data(tmp, data, 0, sched_data_free);
+        tmp->reschedule = period;
+        tmp->flag = 0;
+        tmp->periodic = 1;
+        tmp->period_mode = mode;
+        tmp->catchup = catchup;
+        tmp->missed = 0;
+        tmp->slack = 0;
+        tmp->when = 0;
+        tmp->retry_times = -1;
+        sched_settime(&tmp->when, when ? when : period, 0);
+        if (sched_index_add(con, tmp)) {
+            scheduler_release(con, tmp);
+        } else if (add_scheduler(con, tmp)) {
+            scheduler_release(con, tmp);
+        } else {
+            tmp->state = SCHED_QUEUED;
+            res = tmp->id;
+            due = tmp->when;
+            sched_stat_add(&con->stats.adds, 1);
+            spd_log(LOG_DEBUG, "added periodic event %d callback %p data %p every %dms (%d in Q)\n",
+                tmp->id, tmp->callback, tmp->data, period, con->schedsnt);
+        }
+    }
+    sched_wake(con, due);
+    sched_mutex_unlock(con);
+
+    return res;
+}
+
+spd_sched_handle_t spd_sched_add_handle(struct scheduler_context * con, int when, spd_scheduler_cb callback, void* data, int flag, int retry_times)
+{
+    spd_sched_handle_t handle = SPD_SCHED_HANDLE_INVALID;
+
+    if (sched_add(con, when, 0, callback, data, 0, sched_data_free, flag, retry_times, &handle))
+        return SPD_SCHED_HANDLE_INVALID;
+    return handle;
+}
+
+int spd_sched_add(struct scheduler_context * con, int when, spd_scheduler_cb callback, void * data)
+{
+    return spd_sched_add_flag(con, when, callback,data, 0, -1);
+}
+
+int spd_sched_add_batch(struct scheduler_context * con, const struct spd_sched_req *reqs, int n, int *ids_out)
+{
+    const struct spd_sched_req *req;
+    struct scheduler *tmp;
+    spd_ns_t now, due = SPD_SCHED_NEVER;
+    int i, id, bulk, added = 0;
+
+    if (NULL == con || (n > 0 && NULL == reqs) || n < 0)
+        return -1;
+
+    sched_lock(con);
+    now = spd_nsnow();
+    bulk = sched_queue_bulk_begin(con, n);
+
+    for (i = 0; i < n; i++) {
+        req = &reqs[i];
+        id = -1;
+        if ((req->flag || req->when > 0) && req->slack >= 0 && (tmp = sched_alloc())) {
+            tmp->id = sched_next_id(con);
+            tmp->slot = 0;
+            tmp->callback = req->callback;
+            sched_set_data(tmp, req->data, 0, sched_data_free);
+            tmp->reschedule = req->when;
+            tmp->flag = req->flag;
+            tmp->when = 0;
+            tmp->retry_times = req->retry_times ? req->retry_times : 1; /* retry_times is at least 1*/
+            tmp->slack = req->slack;
+            sched_settime_at(&tmp->when, req->when, tmp->slack, now);
+            if (sched_index_add(con, tmp)) {
+                scheduler_release(con, tmp);
+            } else if (sched_queue_bulk_add(con, tmp, bulk)) {
+                scheduler_release(con, tmp);
+            } else {
+                tmp->state = SCHED_QUEUED;
+                id = tmp->id;
+                if (tmp->when < due)
+                    due = tmp->when;
+            }
+        }
+        if (ids_out)
+            ids_out[i] = id;
+        if (id > 0)
+            added++;
+    }
+    sched_queue_bulk_end(con, bulk);
+    sched_stat_add(&con->stats.adds, added);
+
+    sched_wake(con, due);
+    sched_mutex_unlock(con);
+
+    spd_log(LOG_DEBUG, "added %d of %d events\n", added, n);
+    return added;
+}
+
+int spd_sched_reserve(struct scheduler_context *con, unsigned int n)
+{
+    unsigned int size;
+    int res = 0;
+
+    if (n > INT_MAX / 4)
+        return -1;
+
+    sched_lock(con);
+    for (size = con->idmask + 1; (con->idcnt + n) * 2 > size; size *= 2)
+        ;
+    if (size != con->idmask + 1 && sched_index_resize(con, size))
+        res = -1;
+    if (con->qtype == SPD_SCHED_QUEUE_HEAP && sched_heap_reserve(con, con->schedsnt + n))
+        res = -1;
+    sched_mutex_unlock(con);
+
+    if (sched_slab_reserve(n))
+        res = -1;
+    return res;
+}
+
+void spd_sched_trim(struct scheduler_context *con)
+{
+    struct scheduler **q;
+    unsigned int size;
+
+    sched_lock(con);
+    /* keep the heap at most half empty and the index at most a quarter full */
+    if (con->qtype == SPD_SCHED_QUEUE_HEAP) {
+        for (size = SPD_SCHED_HEAP_INITIAL; size < con->schedsnt * 2; size *= 2)
+            ;
+        if (size < con->schedqmax && (q = SCHED_REALLOC(con->schedulerq, size * sizeof(*q)))) {
+            sched_mem_charge(con, -(long)(con->schedqmax - size) * (long)sizeof(*q));
+            con->schedulerq = q;
+            con->schedqmax = size;
+        }
+    }
+    for (size = SPD_SCHED_INDEX_INITIAL; size < con->idcnt * 4; size *= 2)
+        ;
+    if (size < con->idmask + 1)
+        sched_index_resize(con, size);
+    sched_mutex_unlock(con);
+
+    sched_slab_trim();
+}
+
+int spd_sched_get_mem(struct scheduler_context *con, struct spd_sched_mem *mem)
+{
+#ifdef MALLOC_DEBUG
+    sched_lock(con);
+    mem->bytes = con->memused;
+    mem->peak = con->mempeak;
+    sched_mutex_unlock(con);
+    return 0;
+#else
+    memset(mem, 0, sizeof(*mem));
+    return -1;
+#endif
+}
+
+/*! \brief
+ * Delete the schedule entry with number
+ * "id".  It's nearly impossible that there
+ * would be two or more in the list with that
+ * id.
+ */
+static int sched_del(struct scheduler_context * c, struct scheduler *s)
+{
+    if(s && __atomic_load_n(&s->state, __ATOMIC_ACQUIRE) == SCHED_QUEUED) {
+        sched_queue_remove(c, s);
+        scheduler_release(c, s);
+        sched_stat_add(&c->stats.dels, 1);
+        return 0;
+    }
+    /* a worker has not picked it up yet, it will drop it instead of running it */
+    if(s && __sync_bool_compare_and_swap(&s->state, SCHED_PENDING, SCHED_CANCELLED)) {
+        sched_stat_add(&c->stats.dels, 1);
+        return 0;
+    }
+    /* already ran in this runall batch, the requeue releases it instead */
+    if(s && __sync_bool_compare_and_swap(&s->state, SCHED_DONE, SCHED_CANCELLED)) {
+        sched_stat_add(&c->stats.dels, 1);
+        return 0;
+    }
+    /* a running event can not be deleted, its callback should return 0 */
+    return -1;
+}
+
+int spd_sched_del(struct scheduler_context * c, int id)
+{
+    int res = -1;
+
+    sched_lock(c);
+    if (id > 0)
+        res = sched_del(c, sched_index_find(c, id));
+    sched_mutex_unlock(c);
+
+    if(res) {
+        //spd_log(LOG_WARNING, "ask to delete null schedule\n");
+        spd_log(LOG_DEBUG,"ask to delete null schedule\n");
+    }
+
+    return res;
+}
+
+int spd_sched_del_handle(struct scheduler_context * c, spd_sched_handle_t handle)
+{
+    int res;
+
+    sched_mutex_lock(c);
+    res = sched_del(c, sched_slot_find(c, handle));
+    sched_mutex_unlock(c);
+
+    return res;
+}
+
+/*! \brief
+ * Move a queued event to 'when' ms from now. It keeps its entry, id and
+ * place in the index, and the dispatcher is only woken if the event is
+ * now due before it would wake up anyway.
+ */
+static int sched_mod(struct scheduler_context * c, struct scheduler *s, int when)
+{
+    spd_ns_t due = 0;
+    int state = s ? __atomic_load_n(&s->state, __ATOMIC_ACQUIRE) : SCHED_RUNNING;
+
+    /* a pending or running event is out of the queue, its callback decides what comes next */
+    if (state != SCHED_QUEUED && state != SCHED_DONE)
+        return -1;
+    sched_settime(&due, when, s->slack);
+    if (state == SCHED_DONE) {
+        /* waiting in a runall batch, the requeue picks up the new time */
+        s->when = due;
+        sched_stat_add(&c->stats.mods, 1);
+        return 0;
+    }
+    sched_queue_move(c, s, due);
+    sched_stat_add(&c->stats.mods, 1);
+    sched_wake(c, due);
+    return 0;
+}
+
+int spd_sched_mod(struct scheduler_context * c, int id, int when)
+{
+    int res = -1;
+
+    if (when < 0)
+        return -1;
+    sched_lock(c);
+    if (id > 0)
+        res = sched_mod(c, sched_index_find(c, id), when);
+    sched_mutex_unlock(c);
+
+    return res;
+}
+
+int spd_sched_mod_handle(struct scheduler_context * c, spd_sched_handle_t handle, int when)
+{
+    int res = -1;
+
+    if (when < 0)
+        return -1;
+    sched_mutex_lock(c);
+    res = sched_mod(c, sched_slot_find(c, handle), when);
+    sched_mutex_unlock(c);
+
+    return res;
+}
+
+static int sched_dump_entry(struct scheduler *q, void *arg)
+{
+    struct timeval delta = spd_ns2tv(q->when - *(spd_ns_t *)arg);
+        spd_log(LOG_DEBUG, "|%.4d | %-15p | %-15p | %.6ld : %.6ld |\n", 
+            q->id,
+            q->callback,
+            q->data,
+            delta.tv_sec,
+            (long int)delta.tv_usec);
+    /* a long queue would overflow the ring, write it out as we go */
+    if (sched_log_self && __atomic_load_n(&sched_log_self->head, __ATOMIC_RELAXED)
+        - __atomic_load_n(&sched_log_self->tail, __ATOMIC_ACQUIRE) >= SPD_SCHED_LOG_RING / 2)
+        sched_log_drain();
+    return 0;
+}
+
+void spd_sched_dump(const struct scheduler_context *con)
+{
+    spd_ns_t tv;
+
+    /* nothing would be written, do not walk the queue */
+    if (LOG_DEBUG > SPD_SCHED_LOG_MAX || !sched_log_enabled(LOG_DEBUG))
+        return;
+    sched_log_drain();
+    tv = spd_nsnow();
+
+#ifdef SPD_SCHED_MA_CACHE  
+    spd_log(LOG_DEBUG, " Schedule Dump (%d in Q, %d Total, %d Cache)\n", con->schedsnt, con->processedcnt- 1, sched_slab.nfree);
+#else
+    spd_log(LOG_DEBUG, " Schedule Dump (%d in Q, %d Total)\n", con->schedsnt, con->processedcnt- 1);
+#endif
+
+    spd_log(LOG_DEBUG, "=============================================================\n");
+    spd_log(LOG_DEBUG, "|ID    Callback          Data              Time  (sec:ms)   |\n");
+    spd_log(LOG_DEBUG, "+-----+-----------------+-----------------+-----------------+\n");
+    /* entries are listed in queue order, not sorted by time */
+    sched_queue_walk(con, sched_dump_entry, &tv);
+    spd_log(LOG_DEBUG, "=============================================================\n");
+    sched_log_drain();
+}
+
+static void sched_hist_copy(struct spd_sched_hist *dst, const struct spd_sched_hist *src)
+{
+    int i;
+
+    for (i = 0; i < SPD_SCHED_HIST_BUCKETS; i++)
+        dst->count[i] = __atomic_load_n(&src->count[i], __ATOMIC_RELAXED);
+    dst->sum = __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+    dst->max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+}
+
+int spd_sched_get_stats(struct scheduler_context *con, struct spd_sched_stats *st)
+{
+    int i;
+
+    sched_lock(con);
+    st->adds = __atomic_load_n(&con->stats.adds, __ATOMIC_RELAXED);
+    st->dels = __atomic_load_n(&con->stats.dels, __ATOMIC_RELAXED);
+    st->reschedules = __atomic_load_n(&con->stats.reschedules, __ATOMIC_RELAXED);
+    st->exhausted = __atomic_load_n(&con->stats.exhausted, __ATOMIC_RELAXED);
+    st->wakeups = __atomic_load_n(&con->stats.wakeups, __ATOMIC_RELAXED);
+    st->missed = __atomic_load_n(&con->stats.missed, __ATOMIC_RELAXED);
+    st->mods = __atomic_load_n(&con->stats.mods, __ATOMIC_RELAXED);
+    st->depth = con->schedsnt;
+    st->depthmax = con->stats.depthmax;
+    sched_mutex_unlock(con);
+    /* callbacks keep running while the histograms are copied */
+    sched_hist_copy(&st->lateness, &con->stats.lateness);
+    sched_hist_copy(&st->runtime, &con->stats.runtime);
+    sched_hist_copy(&st->lockwait, &con->stats.lockwait);
+    sched_hist_copy(&st->lockhold, &con->stats.lockhold);
+    for (i = 0, st->fires = 0; i < SPD_SCHED_HIST_BUCKETS; i++)
+        st->fires += st->runtime.count[i];
+    return 0;
+}
+
+uint64_t spd_sched_hist_value(int bucket)
+{
+    if (bucket < SPD_SCHED_HIST_SUB)
+        return bucket;
+    return (uint64_t)(SPD_SCHED_HIST_SUB + bucket % SPD_SCHED_HIST_SUB) << (bucket / SPD_SCHED_HIST_SUB - 1);
+}
+
+uint64_t spd_sched_hist_percentile(const struct spd_sched_hist *h, double pct)
+{
+    uint64_t total = 0, seen = 0, value;
+    int i;
 
-    if (!SPD_LIST_EMPTY(&c->schedulerq))
-        pthread_mutex_lock(&c->lock);
-    
-    for(numevents = 0; !SPD_LIST_EMPTY(&c->schedulerq); numevents++) {
-        /* schedule all events which are going to expire within 1ms.
-         * We only care about millisecond accuracy anyway, so this will
-         * help us get more than one event at one time if they are very
-         * close together.
-         */
-        tv = spd_tvadd(spd_tvnow(), spd_tv(0, 1000));
-        if(spd_tvcmp(SPD_LIST_FIRST(&c->schedulerq)->when, tv) != -1)
-        {
-            
-            pthread_mutex_unlock(&c->lock);
+    for (i = 0; i < SPD_SCHED_HIST_BUCKETS; i++)
+        total += h->count[i];
+    if (!total)
+        return 0;
+    for (i = 0; i < SPD_SCHED_HIST_BUCKETS - 1; i++) {
+        seen += h->count[i];
+        if (seen * 100.0 >= pct * total)
             break;
-        }
+    }
+    /* report the top of the bucket, but never more than was seen */
+    value = i < SPD_SCHED_HIST_BUCKETS - 1 ? spd_sched_hist_value(i + 1) - 1 : h->max;
+    return value < h->max ? value : h->max;
+}
 
-        /* remove this task from list. */
-        cur = SPD_LIST_REMOVE_HEAD(&c->schedulerq, list);
-        c->schedsnt--;
+/*! \brief
+ * Run the callback of an event the caller has taken out of the queue
+ * and count down its retries. 'now' is a clock reading taken after
+ * the event was picked, it is advanced to the end of the callback.
+ * \return the result of the callback
+ */
+static int sched_run(struct scheduler_context *c, struct scheduler *cur, spd_ns_t *now)
+{
+    spd_ns_t start = *now;
+    unsigned int missed;
+    int res;
 
+    sched_hist_add(&c->stats.lateness, start - cur->when);
+    if (cur->periodic) {
+        missed = cur->missed;
+        cur->missed = 0;
+        res = cur->tick(cur->data, missed);
+    } else {
+        res = cur->callback(cur->data);
+    }
+    *now = spd_nsnow();
+    /* fires are counted by the runtime histogram */
+    sched_hist_add(&c->stats.runtime, *now - start);
+    if (cur->retry_times > 0)
+    {
+        cur->retry_times -= 1;
+        if (!cur->retry_times && res)
+            sched_stat_add(&c->stats.exhausted, 1);
+    }
+    return res;
+}
 
-        /*
-         * At this point, the schedule queue is still intact.  We
-         * have removed the first event and the rest is still there,
-         * so it's permissible for the callback to add new events, but
-         * trying to delete itself won't work because it isn't in
-         * the schedule queue.  If that's what it wants to do, it 
-         * should return 0.
-         */
+/*! \brief
+ * Next due time of a periodic event whose run ended at 'now'. A
+ * fixed-rate event stays on the grid of its first run: ticks already
+ * past are skipped, folded into one run that is due at once, or left
+ * to run back to back, as its catch-up policy says.
+ */
+static void sched_next_tick(struct scheduler_context *c, struct scheduler *cur, spd_ns_t now)
+{
+    spd_ns_t period = spd_ms2ns(cur->reschedule);
+    uint64_t behind;
 
-        pthread_mutex_unlock(&c->lock);
-        res = cur->callback(cur->data);
-        if (cur->retry_times > 0)
-        {
-            cur->retry_times -= 1;
-        }
-        pthread_mutex_lock(&c->lock);
+    if (cur->period_mode == SPD_SCHED_FIXED_DELAY) {
+        cur->when = now + period;
+        return;
+    }
+    cur->when += period;
+    if (cur->when > now || cur->catchup == SPD_SCHED_CATCHUP_BURST)
+        return;
+    /* the ticks from cur->when up to now are all due */
+    behind = (now - cur->when) / period + 1;
+    if (cur->catchup == SPD_SCHED_CATCHUP_SKIP) {
+        cur->when += behind * period;
+        cur->missed += behind;
+        sched_stat_add(&c->stats.missed, behind);
+    } else {
+        cur->when += (behind - 1) * period;
+        cur->missed += behind - 1;
+        sched_stat_add(&c->stats.missed, behind - 1);
+    }
+}
+
+/*! \brief
+ * Set the due time of an event whose callback returned 'res' at 'now'.
+ * When cur->flag is true the return value is the offset to reschedule
+ * by, otherwise cur->reschedule is.
+ */
+static void sched_next_time(struct scheduler_context *c, struct scheduler *cur, int res, spd_ns_t now)
+{
+    if (cur->periodic)
+        sched_next_tick(c, cur, now);
+    else
+        sched_settime_at(&cur->when, cur->flag ? res : cur->reschedule, cur->slack, now);
+}
 
+/*! \brief
+ * Requeue or release an event whose callback returned 'res' at 'now'.
+ * Must be called with the context locked.
+ */
+static void sched_finish(struct scheduler_context *c, struct scheduler *cur, int res, spd_ns_t now)
+{
 #if 0        
         if(res) {
 #else
@@ -470,17 +3292,16 @@ int spd_sched_runall(struct scheduler_context * c)
             /*
              * If they return non-zero, we should schedule them to be
              * run again.
-             *
-             * when cur->flag is true, use the return value as the offset time to reschedule.
-             * otherwise, use cur->reschedule as the offset.
-             *
-             * sched_settime always return 0 now.
              */
-            if(sched_settime(&cur->when, cur->flag ? res : cur->reschedule)) {
-               scheduler_release(c,cur);
+            sched_next_time(c, cur, res, now);
+            if (add_scheduler(c, cur)) {
+               /* re-add this task to task list failed, drop it. */
+               scheduler_release(c, cur);
             } else {
-               /* re-add this task to task list. */
-               add_scheduler(c, cur);
+               cur->state = SCHED_QUEUED;
+               sched_stat_add(&c->stats.reschedules, 1);
+               /* workers finish out of order, tell the dispatcher if this one is due first */
+               sched_wake(c, cur->when);
             }
         } else {
             /*
@@ -489,32 +3310,555 @@ int spd_sched_runall(struct scheduler_context * c)
              */
             scheduler_release(c, cur);
         }
-        pthread_mutex_unlock(&c->lock);
+}
+
+SPD_LIST_HEAD_NOLOCK(sched_batch, scheduler);
+
+/*! \brief
+ * Put the events run by one spd_sched_runall() pass back in the queue,
+ * or release those which are finished or were deleted before or after
+ * they ran. Only SCHED_DONE events go back, with the time their run
+ * or a later spd_sched_mod() set, so this is a plain merge.
+ * Must be called with the context locked.
+ */
+static void sched_requeue(struct scheduler_context *c, struct sched_batch *done, unsigned int n)
+{
+    struct scheduler *cur;
+    int bulk = sched_queue_bulk_begin(c, n);
+
+    while ((cur = SPD_LIST_REMOVE_HEAD(done, list))) {
+        if (cur->state != SCHED_DONE) {
+            /*
+             * If the task callback return 0, we think this task was finished and should not 
+             * reschedule it. 
+             */
+            scheduler_release(c, cur);
+        } else if (sched_queue_bulk_add(c, cur, bulk)) {
+            /* re-add this task to task list failed, drop it. */
+            scheduler_release(c, cur);
+        } else {
+            cur->state = SCHED_QUEUED;
+            sched_stat_add(&c->stats.reschedules, 1);
+        }
+    }
+    sched_queue_bulk_end(c, bulk);
+}
+
+/*! \brief
+ * Launch all events which need to be run at this time.
+ * \note Every pass reads the clock once and takes all the events due
+ * by then out of the queue in one lock hold. Their callbacks run with
+ * the context unlocked, and the events are merged back into the queue
+ * at the start of the next pass, under the same lock hold that
+ * collects its events.
+ */
+int spd_sched_runall(struct scheduler_context * c)
+{
+    struct sched_batch batch = { NULL, NULL }, done = { NULL, NULL };
+    struct scheduler *cur;
+
+    spd_ns_t tv, now;
+    unsigned int n = 0;
+    int numevents = 0;
+
+    if (!c->schedsnt && !c->lockfree && c->timerfd < 0)
+        return 0;
+
+    sched_lock(c);
+    for (;;) {
+        sched_requeue(c, &done, n);
+
+        /* schedule all events which are going to expire within 1ms.
+         * We only care about millisecond accuracy anyway, so this will
+         * help us get more than one event at one time if they are very
+         * close together.
+         */
+        tv = spd_nsnow() + SPD_NS_PER_MS;
+        for (n = 0; (cur = sched_queue_pop(c, tv)); n++) {
+            /* still deletable until its callback starts */
+            cur->state = SCHED_PENDING;
+            SPD_LIST_INSERT_TAIL(&batch, cur, list);
+        }
+        if (!n)
+            break;
+
+        /*
+         * The rest of the schedule queue is intact, so it's permissible
+         * for a callback to add new events or delete events of this
+         * batch which did not run yet.  Trying to delete itself won't
+         * work because it isn't in the schedule queue.  If that's what
+         * it wants to do, it should return 0.
+         */
+        sched_mutex_unlock(c);
+        now = tv - SPD_NS_PER_MS;
+        while ((cur = SPD_LIST_REMOVE_HEAD(&batch, list))) {
+            SPD_LIST_INSERT_TAIL(&done, cur, list);
+            if (!__sync_bool_compare_and_swap(&cur->state, SCHED_PENDING, SCHED_RUNNING))
+                continue;
+            cur->result = sched_run(c, cur, &now);
+            numevents++;
+            if (cur->result && cur->retry_times) {
+                sched_next_time(c, cur, cur->result, now);
+                /* from here on it can be deleted, queried or moved again */
+                __atomic_store_n(&cur->state, SCHED_DONE, __ATOMIC_RELEASE);
+            }
+        }
+        sched_mutex_lock(c);
     }
+    sched_timerfd_rearm(c);
+    sched_mutex_unlock(c);
 
     return numevents;
 }
 
-long spd_sched_when(struct scheduler_context * con, int id)
+/*! \brief
+ * Move every expired event to the job queue of the workers.
+ */
+static void sched_dispatch(struct scheduler_context *c)
 {
-    struct scheduler *s;
-    long secs = -1;
-    DEBUG(spd_log(LOG_DEBUG, "spd_sched_when()\n"));
+    SPD_LIST_HEAD_NOLOCK(, scheduler) jobs;
+    struct scheduler *cur;
+    spd_ns_t tv;
+    int n = 0;
 
-    pthread_mutex_lock(&con->lock);
-    SPD_LIST_TRAVERSE(&con->schedulerq, s, list) {
-        if (s->id == id)
+    SPD_LIST_HEAD_INIT_NOLOCK(&jobs);
+    tv = spd_nsnow() + SPD_NS_PER_MS;
+    sched_lock(c);
+    while ((cur = sched_queue_pop(c, tv))) {
+        cur->state = SCHED_PENDING;
+        SPD_LIST_INSERT_TAIL(&jobs, cur, list);
+        n++;
+    }
+    sched_mutex_unlock(c);
+
+    if (!n)
+        return;
+    pthread_mutex_lock(&c->joblock);
+    SPD_LIST_APPEND_LIST(&c->jobq, &jobs, list);
+    if (n == 1)
+        pthread_cond_signal(&c->jobcond);
+    else
+        pthread_cond_broadcast(&c->jobcond);
+    pthread_mutex_unlock(&c->joblock);
+}
+
+static void *sched_dispatcher_thread(void *data)
+{
+    struct scheduler_context *c = data;
+#ifndef USE_COND_WAIT
+    int ms;
+#endif
+
+    while (!__atomic_load_n(&c->stop, __ATOMIC_ACQUIRE)) {
+#ifdef USE_COND_WAIT
+        if (spd_sched_cond_wait(c) < 0)
+            break;
+#else
+        /* poll so that stop requests and new early events are noticed */
+        ms = spd_sched_wait(c);
+        if (ms < 0 || ms > 100)
+            ms = 100;
+        if (ms)
+            usleep(ms * 1000);
+#endif
+        sched_dispatch(c);
+    }
+    return NULL;
+}
+
+static void *sched_worker_thread(void *data)
+{
+    struct scheduler_context *c = data;
+    struct scheduler *cur;
+    spd_ns_t now;
+    int res;
+
+    for (;;) {
+        pthread_mutex_lock(&c->joblock);
+        while (SPD_LIST_EMPTY(&c->jobq) && !c->stop)
+            pthread_cond_wait(&c->jobcond, &c->joblock);
+        cur = SPD_LIST_REMOVE_HEAD(&c->jobq, list);
+        pthread_mutex_unlock(&c->joblock);
+        if (!cur)
+            break;
+
+        if (!__sync_bool_compare_and_swap(&cur->state, SCHED_PENDING, SCHED_RUNNING)) {
+            /* deleted while waiting for us */
+            sched_mutex_lock(c);
+            scheduler_release(c, cur);
+            sched_mutex_unlock(c);
+            continue;
+        }
+
+        now = spd_nsnow();
+        res = sched_run(c, cur, &now);
+
+        sched_mutex_lock(c);
+        sched_finish(c, cur, res, now);
+        sched_mutex_unlock(c);
+    }
+    return NULL;
+}
+
+int spd_sched_set_workers(struct scheduler_context *c, int n)
+{
+    if (n < 1 || c->workers)
+        return -1;
+    c->nworkers = n;
+    return 0;
+}
+
+int spd_sched_start(struct scheduler_context *c)
+{
+    int i;
+
+    if (c->workers)
+        return -1;
+    if (!(c->workers = SCHED_CALLOC(c->nworkers, sizeof(*c->workers))))
+        return -1;
+
+    c->stop = 0;
+    for (i = 0; i < c->nworkers; i++) {
+        if (pthread_create(&c->workers[i], NULL, sched_worker_thread, c))
             break;
     }
-    if (s) {
-        struct timeval now = spd_tvnow();
-        secs = s->when.tv_sec - now.tv_sec;
+    if (i < c->nworkers || pthread_create(&c->dispatcher, NULL, sched_dispatcher_thread, c)) {
+        spd_log(LOG_WARNING, "failed to start scheduler threads\n");
+        pthread_mutex_lock(&c->joblock);
+        c->stop = 1;
+        pthread_cond_broadcast(&c->jobcond);
+        pthread_mutex_unlock(&c->joblock);
+        while (i--)
+            pthread_join(c->workers[i], NULL);
+        SAFE_FREE(c->workers);
+        c->stop = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void spd_sched_stop(struct scheduler_context *c)
+{
+    int i;
+
+    if (!c->workers)
+        return;
+
+    sched_mutex_lock(c);
+    pthread_mutex_lock(&c->joblock);
+    __atomic_store_n(&c->stop, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&c->joblock);
+#ifdef USE_COND_WAIT
+    pthread_cond_broadcast(&c->cond);
+#endif
+    sched_mutex_unlock(c);
+    pthread_join(c->dispatcher, NULL);
+
+    /* the workers run whatever is left in the job queue before they exit */
+    pthread_mutex_lock(&c->joblock);
+    pthread_cond_broadcast(&c->jobcond);
+    pthread_mutex_unlock(&c->joblock);
+    for (i = 0; i < c->nworkers; i++)
+        pthread_join(c->workers[i], NULL);
+    SAFE_FREE(c->workers);
+    c->stop = 0;
+}
+
+#ifdef USE_COND_WAIT
+/*! \brief Sharded scheduling context
+ * \note Each shard is an ordinary context with its own lock and
+ * dispatcher thread. The shard number is kept in the low bits of
+ * every id so deletes go straight to the owning shard.
+ */
+struct sched_shard {
+    struct scheduler_context *con;
+    struct scheduler_shards *shards;
+    pthread_t thread;
+    int busy;                                          /*!< Its dispatcher is running callbacks */
+    int steal;                                         /*!< Asked to help a busier shard */
+} __attribute__((aligned(64)));
+
+struct scheduler_shards {
+    int nshards;
+    unsigned int bits;                                 /*!< Id bits holding the shard number */
+    int stop;
+    int started;
+    struct sched_shard *shard;
+};
+
+/*! \brief Max events a dispatcher takes from another shard in one go */
+#define SPD_SCHED_STEAL_BATCH  16
+
+/*! \brief
+ * Pop one event due before 'limit' and run it.
+ * \param more set to whether more events are due after this one
+ * \return 1 if an event was run, 0 if none was due or the lock was busy
+ */
+static int sched_run_next(struct scheduler_context *c, spd_ns_t limit, int trylock, int *more)
+{
+    struct scheduler *cur, *next;
+    spd_ns_t now;
+    int res;
+
+    if (trylock) {
+        if (sched_mutex_trylock(c))
+            return 0;
+        sched_inbox_drain(c);
+    } else {
+        sched_lock(c);
+    }
+    if (!(cur = sched_queue_pop(c, limit))) {
+        sched_mutex_unlock(c);
+        *more = 0;
+        return 0;
+    }
+    cur->state = SCHED_RUNNING;
+    *more = (next = sched_queue_first(c)) && next->when < limit;
+    sched_mutex_unlock(c);
+
+    now = spd_nsnow();
+    res = sched_run(c, cur, &now);
+
+    sched_mutex_lock(c);
+    sched_finish(c, cur, res, now);
+    sched_mutex_unlock(c);
+    return 1;
+}
+
+/*! \brief
+ * Wake an idle shard so it steals from 'self', which has a backlog.
+ */
+static void sched_shard_poke(struct sched_shard *self)
+{
+    struct scheduler_shards *sh = self->shards;
+    struct sched_shard *other;
+    int i, n = self - sh->shard;
+
+    for (i = 1; i < sh->nshards; i++) {
+        other = &sh->shard[(n + i) % sh->nshards];
+        if (__atomic_load_n(&other->busy, __ATOMIC_RELAXED) || __atomic_load_n(&other->steal, __ATOMIC_RELAXED))
+            continue;
+        sched_mutex_lock(other->con);
+        __atomic_store_n(&other->steal, 1, __ATOMIC_RELAXED);
+        pthread_cond_signal(&other->con->cond);
+        sched_mutex_unlock(other->con);
+        return;
+    }
+}
+
+/*! \brief
+ * Run the due events of busy shards other than 'self'.
+ */
+static void sched_shard_steal(struct sched_shard *self)
+{
+    struct scheduler_shards *sh = self->shards;
+    struct sched_shard *victim;
+    spd_ns_t tv;
+    int i, more, stolen;
+
+    for (i = 1; i < sh->nshards; i++) {
+        victim = &sh->shard[((self - sh->shard) + i) % sh->nshards];
+        if (!__atomic_load_n(&victim->busy, __ATOMIC_RELAXED))
+            continue;
+        tv = spd_nsnow() + SPD_NS_PER_MS;
+        for (stolen = 0, more = 1; more && stolen < SPD_SCHED_STEAL_BATCH; stolen++) {
+            if (!sched_run_next(victim->con, tv, 1, &more))
+                break;
+        }
+    }
+}
+
+static void *sched_shard_thread(void *data)
+{
+    struct sched_shard *self = data;
+    struct scheduler_context *c = self->con;
+    struct scheduler *first;
+    spd_ns_t tv;
+    int more, steal;
+
+    while (!__atomic_load_n(&self->shards->stop, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&self->busy, 1, __ATOMIC_RELAXED);
+        tv = spd_nsnow() + SPD_NS_PER_MS;
+        while (sched_run_next(c, tv, 0, &more) && more)
+            sched_shard_poke(self);
+        __atomic_store_n(&self->busy, 0, __ATOMIC_RELAXED);
+
+        sched_lock(c);
+        while (!__atomic_load_n(&self->shards->stop, __ATOMIC_ACQUIRE) && !__atomic_load_n(&self->steal, __ATOMIC_RELAXED)) {
+            if ((first = sched_queue_first(c))) {
+                tv = spd_nsnow() + SPD_NS_PER_MS;
+                if (first->when < tv)
+                    break;
+                sched_cond_sleep(c, first->when);
+            } else {
+                sched_cond_sleep(c, SPD_SCHED_NEVER);
+            }
+        }
+        steal = __atomic_exchange_n(&self->steal, 0, __ATOMIC_RELAXED);
+        sched_mutex_unlock(c);
+
+        if (steal)
+            sched_shard_steal(self);
+    }
+    return NULL;
+}
+
+struct scheduler_shards *spd_sched_shards_create(int nshards, enum spd_sched_queue type)
+{
+    struct scheduler_shards *sh;
+    int i;
+
+    if (nshards <= 0 && (nshards = sysconf(_SC_NPROCESSORS_ONLN)) <= 0)
+        nshards = 1;
+    if (!(sh = SCHED_CALLOC(1, sizeof(*sh))))
+        return NULL;
+    if (posix_memalign((void **)&sh->shard, 64, nshards * sizeof(*sh->shard))) {
+        SAFE_FREE(sh);
+        return NULL;
+    }
+    memset(sh->shard, 0, nshards * sizeof(*sh->shard));
+    while ((1 << sh->bits) < nshards)
+        sh->bits++;
+
+    for (i = 0; i < nshards; i++) {
+        if (!(sh->shard[i].con = spd_sched_context_create_type(type))) {
+            sh->nshards = i;
+            spd_sched_shards_destroy(sh);
+            return NULL;
+        }
+        sh->shard[i].con->idshift = sh->bits;
+        sh->shard[i].con->idtag = i;
+        sh->shard[i].shards = sh;
+    }
+    sh->nshards = nshards;
+    return sh;
+}
+
+void spd_sched_shards_destroy(struct scheduler_shards *sh)
+{
+    int i;
+
+    spd_sched_shards_stop(sh);
+    for (i = 0; i < sh->nshards; i++)
+        spd_sche_context_destroy(sh->shard[i].con);
+    free(sh->shard);
+    SAFE_FREE(sh);
+}
+
+/*! \brief
+ * The shard of the CPU the caller runs on.
+ */
+static struct scheduler_context *sched_shard_local(struct scheduler_shards *sh)
+{
+    int cpu = sched_getcpu();
+
+    if (cpu < 0)
+        cpu = (int)(((unsigned long)pthread_self() >> 6) & INT_MAX);
+    return sh->shard[cpu % sh->nshards].con;
+}
+
+static struct scheduler_context *sched_shard_of(struct scheduler_shards *sh, int id)
+{
+    int n = id & ((1 << sh->bits) - 1);
+
+    if (id <= 0 || n >= sh->nshards)
+        return NULL;
+    return sh->shard[n].con;
+}
+
+int spd_sched_shards_add_flag(struct scheduler_shards *sh, int when, spd_scheduler_cb callback, void *data, int flag, int retry_times)
+{
+    return spd_sched_add_flag(sched_shard_local(sh), when, callback, data, flag, retry_times);
+}
+
+int spd_sched_shards_add(struct scheduler_shards *sh, int when, spd_scheduler_cb callback, void *data)
+{
+    return spd_sched_shards_add_flag(sh, when, callback, data, 0, -1);
+}
+
+int spd_sched_shards_del(struct scheduler_shards *sh, int id)
+{
+    struct scheduler_context *c = sched_shard_of(sh, id);
+
+    return c ? spd_sched_del(c, id) : -1;
+}
+
+long spd_sched_shards_when(struct scheduler_shards *sh, int id)
+{
+    struct scheduler_context *c = sched_shard_of(sh, id);
+
+    return c ? spd_sched_when(c, id) : -1;
+}
+
+int spd_sched_shards_start(struct scheduler_shards *sh)
+{
+    int i;
+
+    if (sh->started)
+        return -1;
+    sh->stop = 0;
+    for (i = 0; i < sh->nshards; i++) {
+        if (pthread_create(&sh->shard[i].thread, NULL, sched_shard_thread, &sh->shard[i])) {
+            spd_log(LOG_WARNING, "failed to start scheduler shard %d\n", i);
+            sh->started = i;
+            spd_sched_shards_stop(sh);
+            return -1;
+        }
+    }
+    sh->started = sh->nshards;
+    return 0;
+}
+
+void spd_sched_shards_stop(struct scheduler_shards *sh)
+{
+    int i;
+
+    if (!sh->started)
+        return;
+    __atomic_store_n(&sh->stop, 1, __ATOMIC_RELEASE);
+    for (i = 0; i < sh->started; i++) {
+        sched_mutex_lock(sh->shard[i].con);
+        pthread_cond_signal(&sh->shard[i].con->cond);
+        sched_mutex_unlock(sh->shard[i].con);
     }
-    pthread_mutex_unlock(&con->lock);
+    for (i = 0; i < sh->started; i++)
+        pthread_join(sh->shard[i].thread, NULL);
+    sh->started = 0;
+}
+#endif /* USE_COND_WAIT */
+
+static long sched_when(struct scheduler *s)
+{
+    int state = s ? __atomic_load_n(&s->state, __ATOMIC_ACQUIRE) : SCHED_RUNNING;
+
+    if (state != SCHED_QUEUED && state != SCHED_PENDING && state != SCHED_DONE)
+        return -1;
+    return (s->when - spd_nsnow()) / SPD_NS_PER_SEC;
+}
+
+long spd_sched_when(struct scheduler_context * con, int id)
+{
+    long secs;
+    DEBUG(spd_log(LOG_DEBUG, "spd_sched_when()\n"));
+
+    sched_lock(con);
+    secs = sched_when(id > 0 ? sched_index_find(con, id) : NULL);
+    sched_mutex_unlock(con);
     
     return secs;
 }
 
+long spd_sched_when_handle(struct scheduler_context * con, spd_sched_handle_t handle)
+{
+    long secs;
+
+    sched_mutex_lock(con);
+    secs = sched_when(sched_slot_find(con, handle));
+    sched_mutex_unlock(con);
+
+    return secs;
+}
+
 
 struct timeval spd_tvadd(struct timeval a, struct timeval b)
 {
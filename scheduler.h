@@ -25,24 +25,42 @@ extern "C" {
 #include <pthread.h>
 #include <syslog.h>
 #include <stdarg.h>
+#include <stdint.h>
 
+/* Count allocations, see malloc.h. Cheap enough to leave on. */
 #define MALLOC_DEBUG 1
 
-#ifdef MALLOC_DEBUG
 #include "malloc.h"
-#endif
 
 /*! \brief Max num of schedule structs
- * \note The max number of schedule structs to keep around
- * for use.  Undefine to disable schedule structure
- * caching. (Only disable this on very low memory
+ * \note The max number of free schedule structs each thread
+ * keeps around for use. They come from a slab allocator shared
+ * by all contexts, define SPD_SCHED_SLAB_HUGEPAGE to back it
+ * with 2MB huge pages. Undefine to allocate every schedule
+ * structure on its own. (Only disable this on very low memory
  * machines)
  */
 #define SPD_SCHED_MA_CACHE  128
 #define USE_COND_WAIT 1
+/* Define USE_IO_URING to build spd_sched_uring_wait(), needs Linux 5.11 */
+/* Define SPD_SCHED_LOCK_STATS to time the context lock, see struct spd_sched_stats */
 
 struct scheduler_context;
 
+/*! \brief Handle of a scheduled event
+ * \note A handle packs a slot number and a generation counter, so it
+ * resolves without a search and a handle of an event that has already
+ * finished never matches a newer event.
+ */
+typedef uint64_t spd_sched_handle_t;
+
+#define SPD_SCHED_HANDLE_INVALID  ((spd_sched_handle_t)0)
+
+/*! \brief Data structures that can order the events of a context */
+enum spd_sched_queue {
+    SPD_SCHED_QUEUE_HEAP = 0,   /*!< 4-ary min-heap, O(log n) add/delete, exact order */
+    SPD_SCHED_QUEUE_WHEEL,      /*!< Hierarchical timing wheel, O(1) add/delete, 1ms resolution */
+};
 
 /*! \brief New schedule context
  * \note Create a scheduling context
@@ -50,6 +68,16 @@ struct scheduler_context;
  */
 struct scheduler_context *spd_sched_context_create(void);
 
+/*! \brief New schedule context with a given queue
+ * \note Create a scheduling context whose events are kept in the
+ * given data structure. spd_sched_context_create() uses SPD_SCHED_QUEUE_HEAP.
+ * The timing wheel suits large numbers of short timers that are mostly
+ * deleted before they expire.
+ * \param type the queue implementation to use
+ * \return Returns a malloc'd sched_context structure, NULL on failure
+ */
+struct scheduler_context *spd_sched_context_create_type(enum spd_sched_queue type);
+
 /*! \brief destroys a schedule context
  * Destroys (free's) the given sched_context structure
  * \param c Context to free
@@ -64,6 +92,19 @@ void spd_sche_context_destroy(struct scheduler_context *sch);
  */
  typedef int(*spd_scheduler_cb)(void *data);
 
+/*! \brief Sets the least important syslog priority the scheduler logs
+ * Messages are formatted by the calling thread and written out by a
+ * background thread, so enabling LOG_DEBUG does not add system calls
+ * to the scheduler functions. Priorities above SPD_SCHED_LOG_MAX are
+ * not compiled in. The default is LOG_NOTICE.
+ * \param level a syslog priority such as LOG_WARNING or LOG_DEBUG
+ * \return Returns the previous level
+ */
+int spd_sched_set_log_level(int level);
+
+/*! \brief Writes out all pending log messages of all threads */
+void spd_sched_log_flush(void);
+
 /*! \brief Adds a scheduled event
  * Schedule an event to take place at some point in the future.  callback
  * will be called with data as the argument, when milliseconds into the
@@ -93,6 +134,159 @@ int spd_sched_add(struct scheduler_context *con, int when, spd_scheduler_cb call
  */
 int spd_sched_add_flag(struct scheduler_context *con, int when, spd_scheduler_cb callback, void* data, int flag, int retry_times);
 
+/*! \brief Adds a scheduled event known by handle
+ * Same as spd_sched_add_flag(), but the event is identified by a
+ * handle instead of an id. It can only be deleted, moved or queried with
+ * spd_sched_del_handle(), spd_sched_mod_handle() and spd_sched_when_handle().
+ * \return Returns the handle on success, SPD_SCHED_HANDLE_INVALID on failure
+ */
+spd_sched_handle_t spd_sched_add_handle(struct scheduler_context *con, int when, spd_scheduler_cb callback, void* data, int flag, int retry_times);
+
+/*! \brief Largest payload spd_sched_add_inline() copies into the event */
+#define SPD_SCHED_INLINE_DATA 48
+
+/*! \brief Releases the data of an event
+ * Called with the context locked when the event is freed, so it must
+ * not call back into the scheduler of the same context.
+ */
+typedef void (*spd_sched_destroy_cb)(void *data);
+
+/*! \brief Adds a scheduled event carrying a copy of its data
+ * Same as spd_sched_add_flag(), but the len bytes at data are copied
+ * into the event itself and the callback gets a pointer to that copy,
+ * which stays valid as long as the event exists. Nothing is freed
+ * when the event goes away.
+ * \param data payload to copy, may be NULL if len is 0
+ * \param len size of the payload, at most SPD_SCHED_INLINE_DATA
+ * \return Returns a schedule item ID on success, -1 on failure
+ */
+int spd_sched_add_inline(struct scheduler_context *con, int when, spd_scheduler_cb callback, const void *data, size_t len, int flag, int retry_times);
+
+/*! \brief Adds a scheduled event with its own destructor
+ * Same as spd_sched_add_flag(), but destroy(data) is called instead of
+ * free(data) when the event is freed. If destroy is NULL the data is
+ * left to the caller.
+ * \return Returns a schedule item ID on success, -1 on failure
+ */
+int spd_sched_add_destroy(struct scheduler_context *con, int when, spd_scheduler_cb callback, void *data, spd_sched_destroy_cb destroy, int flag, int retry_times);
+
+/*! \brief Adds a scheduled event which may run a little late
+ * Same as spd_sched_add_flag(), but the event may run up to slack ms
+ * after 'when'. Within that window it is put on the instant with the
+ * most trailing zero bits, like the kernel's timer slack, so events
+ * whose windows overlap are due together and run on one wakeup of the
+ * dispatcher. Events added with a slack of 0 keep their exact time.
+ * Every run of a rescheduled event gets the same slack.
+ * \param slack milliseconds the event may run late
+ * \return Returns a schedule item ID on success, -1 on failure
+ */
+int spd_sched_add_slack(struct scheduler_context *con, int when, int slack, spd_scheduler_cb callback, void *data, int flag, int retry_times);
+
+/*! \brief How the runs of a periodic event are timed */
+enum spd_sched_period {
+    SPD_SCHED_FIXED_RATE,        /*!< On a grid of the period from the first run, whatever the runs take */
+    SPD_SCHED_FIXED_DELAY,       /*!< One period after the previous run ended */
+};
+
+/*! \brief What a fixed-rate event does about ticks that went by while it was late */
+enum spd_sched_catchup {
+    SPD_SCHED_CATCHUP_SKIP,      /*!< Drop them and wait for the next tick of the grid */
+    SPD_SCHED_CATCHUP_COALESCE,  /*!< Run once at once for all of them */
+    SPD_SCHED_CATCHUP_BURST,     /*!< Run once for every one of them, back to back */
+};
+
+/*! \brief Callback of a periodic event
+ * \param missed ticks skipped or folded into this run since the previous run
+ * \return 0 to stop the event, anything else to keep it running
+ */
+typedef int (*spd_sched_periodic_cb)(void *data, unsigned int missed);
+
+/*! \brief Adds a periodic event
+ * The event runs every 'period' ms until its callback returns 0 or it is
+ * deleted with spd_sched_del(). A fixed-rate event never drifts: its runs
+ * are due on the grid of the first one, and a late run does not move the
+ * ones after it. When whole ticks were missed, 'catchup' decides whether
+ * they are skipped, folded into one run or run back to back; the
+ * callback is told how many it did not get. A callback that keeps taking
+ * longer than the period never catches up with SPD_SCHED_CATCHUP_BURST.
+ * Data is freed like for spd_sched_add_flag().
+ * \param when milliseconds until the first run, 0 for one period
+ * \param period milliseconds between runs
+ * \return Returns a schedule item ID on success, -1 on failure
+ */
+int spd_sched_add_periodic(struct scheduler_context *con, int when, int period, enum spd_sched_period mode,
+    enum spd_sched_catchup catchup, spd_sched_periodic_cb callback, void *data);
+
+/*! \brief One event of a batch added with spd_sched_add_batch() */
+struct spd_sched_req {
+    int when;                     /*!< milliseconds to wait for the event to occur */
+    spd_scheduler_cb callback;    /*!< function to call when the time expires */
+    void *data;                   /*!< data to pass to the callback */
+    int flag;                     /*!< same as for spd_sched_add_flag() */
+    int retry_times;              /*!< same as for spd_sched_add_flag() */
+    int slack;                    /*!< same as for spd_sched_add_slack(), 0 for an exact time */
+};
+
+/*! \brief Adds several scheduled events at once
+ * Same as calling spd_sched_add_flag() for every request, but the
+ * context is locked once, all events are timed from the same moment
+ * and the dispatcher is woken at most once. A batch at least as large
+ * as the queue is appended and ordered in one pass.
+ * \param con Scheduler context to add
+ * \param reqs the events to add
+ * \param n number of entries in reqs
+ * \param ids_out if not NULL, receives the id of every request, -1 for those that failed
+ * \return Returns the number of events added, -1 if the arguments are invalid
+ */
+int spd_sched_add_batch(struct scheduler_context *con, const struct spd_sched_req *reqs, int n, int *ids_out);
+
+/*! \brief Preallocates room for events
+ * Makes sure n more events can be added without growing the queue or
+ * the id index and without mapping memory for the events.
+ * \param con Context to use
+ * \param n number of events to make room for
+ * \return Returns 0 on success, -1 if the memory could not be allocated
+ */
+int spd_sched_reserve(struct scheduler_context *con, unsigned int n);
+
+/*! \brief Returns memory left over from a burst of events
+ * Shrinks the queue and the id index to what the current events need,
+ * hands the free events cached by the calling thread back and unmaps
+ * the slab chunks none of whose events is in use.
+ * \param con Context to use
+ */
+void spd_sched_trim(struct scheduler_context *con);
+
+/*! \brief Memory held by a context */
+struct spd_sched_mem {
+    size_t bytes;    /*!< Bytes held by the context, its tables and its events */
+    size_t peak;     /*!< Most bytes held since the context was created */
+};
+
+/*! \brief Gets the memory held by a context
+ * Events count with the size of their slab entry, the data they
+ * carry is not counted.
+ * \param con Context to use
+ * \param mem receives the figures
+ * \return Returns 0, -1 when built without MALLOC_DEBUG
+ */
+int spd_sched_get_mem(struct scheduler_context *con, struct spd_sched_mem *mem);
+
+/*! \brief Switches the lock-free add path on or off
+ * When on, spd_sched_add() and spd_sched_add_flag() never take the
+ * context lock: the event is pushed on a lock-free queue and its id is
+ * returned at once. The queue is moved into the schedule by the next
+ * thread that locks the context (the dispatcher before every pass, or
+ * a delete or query), so such an id can be deleted right away. The
+ * context lock is only taken to wake a sleeping dispatcher.
+ * Once the id counter wraps, ids have to be checked against the live
+ * events, so from then on adds take the locked path again.
+ * \param con Context to use
+ * \param enable non-zero to switch the lock-free path on
+ * \return Returns 0
+ */
+int spd_sched_set_lockfree(struct scheduler_context *con, int enable);
+
 /*! \brief Deletes a scheduled event
  * Remove this event from being run.  A procedure should not remove its
  * own event, but return 0 instead.
@@ -102,6 +296,30 @@ int spd_sched_add_flag(struct scheduler_context *con, int when, spd_scheduler_cb
  */
 int spd_sched_del(struct scheduler_context *c, int id);
 
+/*! \brief Deletes a scheduled event by handle
+ * \param con scheduling context to delete item from
+ * \param handle handle returned by spd_sched_add_handle()
+ * \return Returns 0 on success, -1 if the event is running or already gone
+ */
+int spd_sched_del_handle(struct scheduler_context *c, spd_sched_handle_t handle);
+
+/*! \brief Reschedules a queued event
+ * Moves the event to 'when' ms from now, earlier or later, as a restarted
+ * idle or keepalive timer needs. The event keeps its id, data and
+ * reschedule interval, nothing is allocated or freed, and the dispatcher
+ * is only woken if the event is now due before it would wake up anyway.
+ * An event with slack keeps it. A periodic event's later runs follow the
+ * new time.
+ * \param con scheduling context of the event
+ * \param id ID of the scheduled item to move
+ * \param when milliseconds from now, 0 for at once
+ * \return Returns 0 on success, -1 if the event is running, about to run or gone
+ */
+int spd_sched_mod(struct scheduler_context *c, int id, int when);
+
+/*! \brief Reschedules a queued event by handle, see spd_sched_mod() */
+int spd_sched_mod_handle(struct scheduler_context *c, spd_sched_handle_t handle, int when);
+
 #ifdef USE_COND_WAIT
 int spd_sched_cond_wait(struct scheduler_context * c);
 #else
@@ -126,22 +344,215 @@ int spd_sched_wait(struct scheduler_context *c);
  */
 int spd_sched_runall(struct scheduler_context *c);
 
+/*! \brief Returns a file descriptor to drive the context from an event loop
+ * The descriptor is a non-blocking timerfd on CLOCK_MONOTONIC, armed
+ * for the first event and pulled in whenever an earlier one is added.
+ * Once it polls readable, call spd_sched_runall(), which runs the due
+ * events, clears it and arms it for the next event. It may become
+ * readable with nothing to run, for instance when the first event was
+ * deleted. The descriptor belongs to the context and is closed by
+ * spd_sche_context_destroy().
+ * \param con Context to use
+ * \return Returns the descriptor, -1 on failure
+ */
+int spd_sched_get_fd(struct scheduler_context *c);
+
+/*! \brief callback for a watched file descriptor
+ * \param fd the descriptor
+ * \param events the epoll events that occurred, EPOLLIN, EPOLLOUT, ...
+ * \param data data given to spd_sched_add_fd()
+ * \return returns a 0 if fd should not be watched anymore, or non-zero if it should
+ */
+typedef int (*spd_sched_fd_cb)(int fd, int events, void *data);
+
+/*! \brief Watches a file descriptor from spd_sched_loop_run()
+ * callback is called on the loop thread, the same thread that runs the
+ * timer callbacks, whenever fd reports one of the events. Adding an fd
+ * that is watched already replaces its events, callback and data.
+ * data is not freed by the context.
+ * \param con Context to use
+ * \param fd descriptor to watch
+ * \param events epoll events to watch for, EPOLLIN, EPOLLOUT, EPOLLET, ...
+ * \param callback function to call when an event occurs
+ * \param data data to pass to the callback
+ * \return Returns 0 on success, -1 on failure
+ */
+int spd_sched_add_fd(struct scheduler_context *con, int fd, int events, spd_sched_fd_cb callback, void *data);
+
+/*! \brief Stops watching a file descriptor
+ * Call it before closing fd.
+ * \return Returns 0 on success, -1 if fd is not watched
+ */
+int spd_sched_del_fd(struct scheduler_context *con, int fd);
+
+/*! \brief Runs timers and watched descriptors on the calling thread
+ * A reactor loop: spd_sched_runall(), then epoll_wait() on the watched
+ * descriptors and the context timerfd (see spd_sched_get_fd()), which
+ * is armed for the first event, then the descriptor callbacks, and
+ * around again. Timers are due to the nanosecond rather than rounded
+ * to an epoll_wait() timeout in ms. Events added from other threads
+ * wake the loop when they are due first. Do not use it together with
+ * spd_sched_start() or another wait function on the same context.
+ * \param con Context to run
+ * \return Returns 0 after spd_sched_loop_stop(), -1 on failure
+ */
+int spd_sched_loop_run(struct scheduler_context *con);
+
+/*! \brief Makes spd_sched_loop_run() return, from any thread or callback */
+void spd_sched_loop_stop(struct scheduler_context *con);
+
+#ifdef USE_IO_URING
+/*! \brief Waits for the next event on an io_uring
+ * Same contract as spd_sched_cond_wait(): returns once the first event
+ * is due, then call spd_sched_runall(). The wait is an absolute
+ * IORING_OP_TIMEOUT on CLOCK_MONOTONIC, submitted in the same system
+ * call that waits for it. Adding an earlier event updates that
+ * timeout in place instead of signalling a condition. The ring is set
+ * up on the first call and belongs to the context.
+ * \param con Context to wait on, only one thread may wait on it
+ * \return Returns 0 when an event is due, -1 if the ring can not be set up
+ */
+int spd_sched_uring_wait(struct scheduler_context *c);
+#endif
+
 /*! \brief Dumps the scheduler contents
  * Debugging: Dump the contents of the scheduler to stderr
  * \param con Context to dump
  */
 void spd_sched_dump(const struct scheduler_context *c);
 
+/*! \brief Log-linear histogram of times in microseconds
+ * \note Values below SPD_SCHED_HIST_SUB have a bucket each, every
+ * following power of two is split into SPD_SCHED_HIST_SUB buckets, so
+ * a value is known to within 25%. The last bucket ends at 2^32us.
+ */
+#define SPD_SCHED_HIST_SUB      4
+#define SPD_SCHED_HIST_BUCKETS  124
+
+struct spd_sched_hist {
+    uint64_t count[SPD_SCHED_HIST_BUCKETS];  /*!< Values that fell in each bucket */
+    uint64_t sum;                            /*!< Sum of all values */
+    uint64_t max;                            /*!< Largest value */
+};
+
+/*! \brief Counters of a context, see spd_sched_get_stats() */
+struct spd_sched_stats {
+    uint64_t adds;           /*!< Events added */
+    uint64_t dels;           /*!< Events deleted before they ran */
+    uint64_t mods;           /*!< Events moved by spd_sched_mod() */
+    uint64_t fires;          /*!< Callbacks run */
+    uint64_t reschedules;    /*!< Events queued again after their callback */
+    uint64_t exhausted;      /*!< Events dropped because they ran out of retries */
+    uint64_t wakeups;        /*!< Times a dispatcher went to sleep waiting for the queue */
+    uint64_t missed;         /*!< Ticks periodic events skipped or folded into one run */
+    unsigned int depth;      /*!< Events in the queue now */
+    unsigned int depthmax;   /*!< Most events ever in the queue */
+    struct spd_sched_hist lateness;  /*!< When callbacks started minus when they were due */
+    struct spd_sched_hist runtime;   /*!< How long callbacks ran */
+    struct spd_sched_hist lockwait;  /*!< Nanoseconds waited for the context lock, needs SPD_SCHED_LOCK_STATS */
+    struct spd_sched_hist lockhold;  /*!< Nanoseconds the context lock was held, needs SPD_SCHED_LOCK_STATS */
+};
+
+/*! \brief Gets the counters of a context
+ * The counters are kept with relaxed atomics as events are added and
+ * run. They are copied one by one, so they may be slightly out of step
+ * with each other while callbacks run.
+ * \param con Context to use
+ * \param st receives the counters
+ * \return Returns 0
+ */
+int spd_sched_get_stats(struct scheduler_context *con, struct spd_sched_stats *st);
+
+/*! \brief Returns the smallest value of histogram bucket 'bucket' */
+uint64_t spd_sched_hist_value(int bucket);
+
+/*! \brief Returns the value in microseconds that 'pct' percent of the
+ * values of a histogram do not exceed, to bucket precision.
+ */
+uint64_t spd_sched_hist_percentile(const struct spd_sched_hist *h, double pct);
+
 /*! \brief Returns the number of seconds before an event takes place
  * \param con Context to use
  * \param id Id to dump
  */
 long spd_sched_when(struct scheduler_context *c, int id);
 
+/*! \brief Returns the number of seconds before an event known by handle takes place
+ * \param con Context to use
+ * \param handle handle returned by spd_sched_add_handle()
+ * \return -1 if the event is running or already gone
+ */
+long spd_sched_when_handle(struct scheduler_context *c, spd_sched_handle_t handle);
+
 
+/*! \brief Sets the number of worker threads used by spd_sched_start()
+ * \param con Context to use
+ * \param n number of workers, defaults to the number of online CPUs
+ * \return Returns 0 on success, -1 if n is invalid or the context is started
+ */
+int spd_sched_set_workers(struct scheduler_context *c, int n);
+
+/*! \brief Starts running the context in its own threads
+ * One dispatcher thread waits for events to expire and hands them to a
+ * pool of worker threads which run the callbacks, so a slow callback does
+ * not hold back the events behind it. Callbacks of different events may
+ * run concurrently and finish in any order; each event is requeued or
+ * released by the worker that ran it. Do not call spd_sched_runall() on a
+ * started context.
+ * \param con Context to start
+ * \return Returns 0 on success, -1 on failure or if already started
+ */
 int spd_sched_start(struct scheduler_context * c);
 
+/*! \brief Stops the threads started by spd_sched_start()
+ * Events that already expired are still run before the workers exit.
+ * spd_sche_context_destroy() calls this as well.
+ * \param con Context to stop
+ */
+void spd_sched_stop(struct scheduler_context *c);
+
 
+#ifdef USE_COND_WAIT
+/*! \brief Sharded scheduling context
+ * A set of independent contexts, one per CPU by default, each with its
+ * own lock and dispatcher thread. Events are added to the shard of the
+ * CPU the caller runs on, so producers on different CPUs do not contend.
+ * A dispatcher that falls behind wakes an idle one, which then runs due
+ * events of the busy shard. Ids carry their shard number, so
+ * spd_sched_shards_del() and spd_sched_shards_when() go straight to it.
+ */
+struct scheduler_shards;
+
+/*! \brief New sharded context
+ * \param nshards number of shards, 0 for one per online CPU
+ * \param type the queue implementation of every shard
+ * \return Returns a malloc'd structure, NULL on failure
+ */
+struct scheduler_shards *spd_sched_shards_create(int nshards, enum spd_sched_queue type);
+
+/*! \brief Stops and frees a sharded context */
+void spd_sched_shards_destroy(struct scheduler_shards *sh);
+
+/*! \brief Same as spd_sched_add() on the shard of the calling CPU */
+int spd_sched_shards_add(struct scheduler_shards *sh, int when, spd_scheduler_cb callback, void *data);
+
+/*! \brief Same as spd_sched_add_flag() on the shard of the calling CPU */
+int spd_sched_shards_add_flag(struct scheduler_shards *sh, int when, spd_scheduler_cb callback, void *data, int flag, int retry_times);
+
+/*! \brief Same as spd_sched_del() on the shard owning id */
+int spd_sched_shards_del(struct scheduler_shards *sh, int id);
+
+/*! \brief Same as spd_sched_when() on the shard owning id */
+long spd_sched_shards_when(struct scheduler_shards *sh, int id);
+
+/*! \brief Starts one dispatcher thread per shard
+ * \return Returns 0 on success, -1 on failure or if already started
+ */
+int spd_sched_shards_start(struct scheduler_shards *sh);
+
+/*! \brief Stops the dispatcher threads of a sharded context */
+void spd_sched_shards_stop(struct scheduler_shards *sh);
+#endif
 
 #if defined(__cplusplus) || defined(c_pluseplus)
 }
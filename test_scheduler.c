@@ -1,7 +1,22 @@
+/*
+ * Behaviour tests of the scheduler, and the original demo.
+ *
+ * Build:  gcc -O2 -I. test_scheduler.c scheduler.c -lpthread -o test_scheduler
+ * Run:    ./test_scheduler          run the tests, the exit status is 1 on failure
+ *         ./test_scheduler demo     run the demo callbacks forever
+ *
+ * The tests run on real time, each takes well under a second, and
+ * every timing check leaves room for a loaded machine.
+ */
 #include "scheduler.h"
+#include "times.h"
 #include "time.h"
 #include "linkedlist.h"
 
+#include <limits.h>
+#include <poll.h>
+#include <sys/epoll.h>
+
 #define MALLOC_DEBUG 1
 struct scheduler_context * sch_con;
 pthread_t timer_sched_t;
@@ -76,7 +91,7 @@ int add_tasks()
     spd_sched_add_flag(sch_con, 100, test_callback_5, data, 1, 50);// max retry is 50 
 }
 
-int main()
+static void demo(void)
 {
     sch_con = spd_sched_context_create();
     pthread_create(&timer_sched_t, NULL, (void *)start_timer_schedule, sch_con);
@@ -86,3 +101,1080 @@ int main()
     spd_sche_context_destroy(sch_con);
 }
 
+static const char *queue_names[] = { "heap", "wheel" };
+static int failures;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+/*! \brief Lateness allowed before a test calls a timer late, a loaded machine steals several ms */
+#define TEST_LATE_MS    30
+
+/* heap and wheel against the same script */
+
+#define ORDER_EVENTS    64
+#define ORDER_LATE      16
+
+struct order_event {
+    spd_ns_t due;
+    int idx;
+};
+
+static struct {
+    struct scheduler_context *c;
+    uint64_t rng;
+    spd_ns_t due[ORDER_EVENTS + ORDER_LATE];
+    spd_ns_t ran[ORDER_EVENTS + ORDER_LATE];
+    int order[ORDER_EVENTS + ORDER_LATE];
+    int fired;
+    int added;
+} order;
+
+static int order_rand(int n)
+{
+    order.rng ^= order.rng << 13;
+    order.rng ^= order.rng >> 7;
+    order.rng ^= order.rng << 17;
+    return order.rng % n;
+}
+
+static int order_cb(void *data)
+{
+    struct order_event *ev = data;
+
+    order.ran[ev->idx] = spd_nsnow();
+    order.order[order.fired++] = ev->idx;
+    return 0;
+}
+
+static void order_add(int when)
+{
+    struct order_event ev = { spd_nsnow() + when * SPD_NS_PER_MS, order.added };
+
+    order.due[ev.idx] = ev.due;
+    order.added++;
+    CHECK(spd_sched_add_inline(order.c, when, order_cb, &ev, sizeof(ev), 0, 1) > 0);
+}
+
+/*! \brief
+ * Runs at 235ms and adds events due from 400ms on. Most land in the inner
+ * wheel, which has wrapped around by then, while the 300ms event still
+ * waits in an outer wheel for the cascade at 256ms. Nothing else is due
+ * in between, so only the deadline the queue reports wakes it in time.
+ */
+static int order_kick_cb(void *data)
+{
+    int i;
+
+    (void)data;
+    for (i = 0; i < ORDER_LATE; i++)
+        order_add(165 + order_rand(200));
+    return 0;
+}
+
+static void test_order(enum spd_sched_queue type, int *seq, spd_ns_t *due)
+{
+    spd_ns_t start;
+    int i, late = 0, disorder = 0;
+
+    memset(&order, 0, sizeof(order));
+    order.rng = 88172645463325252ULL;
+    order.c = spd_sched_context_create_type(type);
+    start = spd_nsnow();
+
+    /* one event due at 300ms, the others before 230ms or from 400ms on */
+    order_add(300);
+    for (i = 1; i < ORDER_EVENTS; i++)
+        order_add(order_rand(2) ? 1 + order_rand(229) : 400 + order_rand(300));
+    spd_sched_add(order.c, 235, order_kick_cb, NULL);
+
+    /* sleep in cond_wait like a dispatcher, so its deadline is what the wheel reports */
+    while (order.fired < order.added && spd_nsnow() < start + 2 * SPD_NS_PER_SEC) {
+        spd_sched_cond_wait(order.c);
+        spd_sched_runall(order.c);
+    }
+
+    CHECK(order.fired == ORDER_EVENTS + ORDER_LATE);
+    memcpy(due, order.due, sizeof(order.due));
+    for (i = 0; i < order.fired; i++) {
+        seq[i] = order.order[i];
+        if (order.ran[i] - order.due[i] > TEST_LATE_MS * SPD_NS_PER_MS || order.ran[i] < order.due[i] - 2 * SPD_NS_PER_MS)
+            late++;
+        /* runall takes what is due within 1ms, ties may come in either order */
+        if (i && order.due[order.order[i]] < order.due[order.order[i - 1]] - 2 * SPD_NS_PER_MS)
+            disorder++;
+    }
+    if (late || disorder)
+        printf("%s: %d events off time, %d out of order, the 300ms one ran at %lldms\n", queue_names[type],
+            late, disorder, (long long)(order.ran[0] - start) / SPD_NS_PER_MS);
+    CHECK(!late);
+    CHECK(!disorder);
+    spd_sche_context_destroy(order.c);
+}
+
+static void test_heap_wheel_order(void)
+{
+    int heap[ORDER_EVENTS + ORDER_LATE], wheel[ORDER_EVENTS + ORDER_LATE];
+    spd_ns_t hdue[ORDER_EVENTS + ORDER_LATE], wdue[ORDER_EVENTS + ORDER_LATE], dh, dw;
+    int i, differ = 0;
+
+    test_order(SPD_SCHED_QUEUE_HEAP, heap, hdue);
+    test_order(SPD_SCHED_QUEUE_WHEEL, wheel, wdue);
+    /*
+     * same script, same order, but for events due within a couple of ms.
+     * The late events are due from when the kick ran, which moves a little
+     * from run to run, so only pairs both runs had well apart count.
+     */
+    for (i = 0; i < ORDER_EVENTS + ORDER_LATE; i++) {
+        dh = hdue[heap[i]] - hdue[wheel[i]];
+        dw = wdue[heap[i]] - wdue[wheel[i]];
+        if ((dh > 2 * SPD_NS_PER_MS && dw > 2 * SPD_NS_PER_MS) || (dh < -2 * SPD_NS_PER_MS && dw < -2 * SPD_NS_PER_MS))
+            differ++;
+    }
+    CHECK(!differ);
+}
+
+/* one-shot events counted by index, callbacks may run on worker threads */
+
+#define TEST_EVENTS     1000
+
+static int fired[TEST_EVENTS];
+static int fired_order[TEST_EVENTS];
+static spd_ns_t fired_at[TEST_EVENTS];
+static int nfired;
+
+static int fire_cb(void *data)
+{
+    int i = *(int *)data, n;
+
+    __atomic_add_fetch(&fired[i], 1, __ATOMIC_RELAXED);
+    fired_at[i] = spd_nsnow();
+    n = __atomic_fetch_add(&nfired, 1, __ATOMIC_RELEASE);
+    if (n < TEST_EVENTS)
+        fired_order[n] = i;
+    return 0;
+}
+
+/*! \brief Data for fire_cb(), freed by the scheduler with the event */
+static int *fire_data(int i)
+{
+    int *p = malloc(sizeof(*p));
+
+    *p = i;
+    return p;
+}
+
+static void fire_reset(void)
+{
+    memset(fired, 0, sizeof(fired));
+    nfired = 0;
+}
+
+/*! \brief Waits until n events fired on threads of their own or ms went by */
+static void test_wait(int n, int ms)
+{
+    spd_ns_t end = spd_nsnow() + ms * SPD_NS_PER_MS;
+
+    while (__atomic_load_n(&nfired, __ATOMIC_ACQUIRE) < n && spd_nsnow() < end)
+        usleep(1000);
+}
+
+/*! \brief Runs the context until n events fired or ms went by */
+static void test_drive(struct scheduler_context *c, int n, int ms)
+{
+    spd_ns_t end = spd_nsnow() + ms * SPD_NS_PER_MS;
+
+    while (nfired < n && spd_nsnow() < end) {
+        usleep(1000);
+        spd_sched_runall(c);
+    }
+}
+
+static void test_handles(void)
+{
+    struct scheduler_context *c;
+    spd_sched_handle_t h1, h2, h3;
+    int type;
+
+    for (type = SPD_SCHED_QUEUE_HEAP; type <= SPD_SCHED_QUEUE_WHEEL; type++) {
+        fire_reset();
+        c = spd_sched_context_create_type(type);
+        h1 = spd_sched_add_handle(c, 1000, fire_cb, fire_data(0), 0, 1);
+        CHECK(h1 != SPD_SCHED_HANDLE_INVALID);
+        CHECK(spd_sched_when_handle(c, h1) >= 0);
+        CHECK(spd_sched_del_handle(c, h1) == 0);
+        CHECK(spd_sched_del_handle(c, h1) == -1);
+
+        /* the freed slot is handed out again with a new generation */
+        h2 = spd_sched_add_handle(c, 5, fire_cb, fire_data(1), 0, 1);
+        CHECK((h2 & 0xffffffffU) == (h1 & 0xffffffffU));
+        CHECK(h2 != h1);
+        CHECK(spd_sched_del_handle(c, h1) == -1);
+        CHECK(spd_sched_when_handle(c, h1) == -1);
+        CHECK(spd_sched_mod_handle(c, h1, 1000) == -1);
+        CHECK(spd_sched_when_handle(c, h2) >= 0);
+
+        /* once it ran its handle is stale too, and a new event does not bring it back */
+        test_drive(c, 1, 500);
+        CHECK(fired[0] == 0 && fired[1] == 1);
+        h3 = spd_sched_add_handle(c, 1000, fire_cb, fire_data(2), 0, 1);
+        CHECK(h3 != h2);
+        CHECK(spd_sched_del_handle(c, h2) == -1);
+        CHECK(spd_sched_when_handle(c, h3) >= 0);
+        spd_sche_context_destroy(c);
+    }
+}
+
+#define INBOX_THREADS   4
+
+static struct {
+    struct scheduler_context *c;
+    int ids[TEST_EVENTS];
+} inbox;
+
+static void *inbox_producer(void *arg)
+{
+    int i, first = (int)(intptr_t)arg * (TEST_EVENTS / INBOX_THREADS);
+
+    for (i = first; i < first + TEST_EVENTS / INBOX_THREADS; i++)
+        inbox.ids[i] = spd_sched_add(inbox.c, 20 + i % 50, fire_cb, fire_data(i));
+    return NULL;
+}
+
+static void test_lockfree_inbox(void)
+{
+    pthread_t threads[INBOX_THREADS];
+    int i, type, dels, bad;
+
+    for (type = SPD_SCHED_QUEUE_HEAP; type <= SPD_SCHED_QUEUE_WHEEL; type++) {
+        fire_reset();
+        inbox.c = spd_sched_context_create_type(type);
+        spd_sched_set_lockfree(inbox.c, 1);
+        for (i = 0; i < INBOX_THREADS; i++)
+            pthread_create(&threads[i], NULL, inbox_producer, (void *)(intptr_t)i);
+        for (i = 0; i < INBOX_THREADS; i++)
+            pthread_join(threads[i], NULL);
+
+        /* the ids are known before any of them reached the queue, the first delete drains the inbox */
+        for (i = 0, dels = 0; i < TEST_EVENTS; i++) {
+            CHECK(inbox.ids[i] > 0);
+            if (!(i % 3) && !spd_sched_del(inbox.c, inbox.ids[i]))
+                dels++;
+        }
+        CHECK(dels == (TEST_EVENTS + 2) / 3);
+        CHECK(spd_sched_when(inbox.c, inbox.ids[1]) >= 0);
+
+        test_drive(inbox.c, TEST_EVENTS - dels, 2000);
+        usleep(20000);
+        spd_sched_runall(inbox.c);
+        CHECK(nfired == TEST_EVENTS - dels);
+        for (i = 0, bad = 0; i < TEST_EVENTS; i++)
+            bad += fired[i] != (i % 3 ? 1 : 0);
+        CHECK(!bad);
+        spd_sche_context_destroy(inbox.c);
+    }
+}
+
+#define BATCH_EVENTS    200
+
+static void test_add_batch(void)
+{
+    struct scheduler_context *c;
+    struct spd_sched_req reqs[BATCH_EVENTS];
+    int ids[BATCH_EVENTS];
+    int i, type, disorder;
+
+    for (type = SPD_SCHED_QUEUE_HEAP; type <= SPD_SCHED_QUEUE_WHEEL; type++) {
+        fire_reset();
+        c = spd_sched_context_create_type(type);
+        memset(reqs, 0, sizeof(reqs));
+        for (i = 0; i < BATCH_EVENTS; i++) {
+            reqs[i].when = 1 + i * 37 % 100;
+            reqs[i].callback = fire_cb;
+            reqs[i].data = fire_data(i);
+            reqs[i].retry_times = 1;
+        }
+        /* a one-shot event due at once and a negative slack are refused, the rest go in */
+        free(reqs[50].data);
+        reqs[50].data = NULL;
+        reqs[50].when = 0;
+        free(reqs[51].data);
+        reqs[51].data = NULL;
+        reqs[51].slack = -1;
+        CHECK(spd_sched_add_batch(c, reqs, BATCH_EVENTS, ids) == BATCH_EVENTS - 2);
+        CHECK(ids[50] == -1 && ids[51] == -1);
+        CHECK(ids[0] > 0 && ids[1] > 0 && ids[0] != ids[1]);
+        CHECK(spd_sched_when(c, ids[BATCH_EVENTS - 1]) >= 0);
+
+        test_drive(c, BATCH_EVENTS - 2, 1000);
+        CHECK(nfired == BATCH_EVENTS - 2);
+        for (i = 0, disorder = 0; i < BATCH_EVENTS; i++) {
+            CHECK(fired[i] == (i == 50 || i == 51 ? 0 : 1));
+            if (i && i < nfired && reqs[fired_order[i]].when < reqs[fired_order[i - 1]].when - 1)
+                disorder++;
+        }
+        CHECK(!disorder);
+        spd_sche_context_destroy(c);
+    }
+}
+
+#define POOL_EVENTS     500
+
+/*! \brief A callback that holds its worker for 100ms */
+static int slow_cb(void *data)
+{
+    usleep(100000);
+    return fire_cb(data);
+}
+
+static void test_worker_pool(void)
+{
+    struct scheduler_context *c;
+    int i, type, bad, n;
+
+    for (type = SPD_SCHED_QUEUE_HEAP; type <= SPD_SCHED_QUEUE_WHEEL; type++) {
+        fire_reset();
+        c = spd_sched_context_create_type(type);
+        CHECK(spd_sched_set_workers(c, 4) == 0);
+        CHECK(spd_sched_start(c) == 0);
+        CHECK(spd_sched_start(c) == -1);
+        CHECK(spd_sched_set_workers(c, 2) == -1);
+
+        /* the slow one is due first, the others must not wait for it */
+        CHECK(spd_sched_add_flag(c, 5, slow_cb, fire_data(0), 0, 1) > 0);
+        for (i = 1; i < POOL_EVENTS; i++)
+            CHECK(spd_sched_add_flag(c, 10 + i % 40, fire_cb, fire_data(i), 0, 1) > 0);
+        test_wait(POOL_EVENTS, 2000);
+        spd_sched_stop(c);
+
+        n = __atomic_load_n(&nfired, __ATOMIC_ACQUIRE);
+        CHECK(n == POOL_EVENTS);
+        for (i = 0, bad = 0; i < POOL_EVENTS; i++)
+            bad += fired[i] != 1;
+        CHECK(!bad);
+        CHECK(fired_at[1] < fired_at[0]);
+
+        /* stopped: nothing runs any more */
+        CHECK(spd_sched_add_flag(c, 1, fire_cb, fire_data(0), 0, 1) > 0);
+        usleep(20000);
+        CHECK(nfired == n);
+        spd_sche_context_destroy(c);
+    }
+}
+
+#define SHARD_PRODUCERS 4
+#define SHARD_EVENTS    400
+#define SHARD_SLOW      40
+
+static struct {
+    struct scheduler_shards *sh;
+    int ids[SHARD_EVENTS];
+    pthread_t ran_on[SHARD_SLOW];
+} shards;
+
+static void *shard_producer(void *arg)
+{
+    int i, first = (int)(intptr_t)arg * (SHARD_EVENTS / SHARD_PRODUCERS);
+
+    for (i = first; i < first + SHARD_EVENTS / SHARD_PRODUCERS; i++)
+        shards.ids[i] = spd_sched_shards_add(shards.sh, 30 + i % 30, fire_cb, fire_data(i));
+    return NULL;
+}
+
+/*! \brief Takes 5ms and notes the dispatcher it ran on */
+static int shard_slow_cb(void *data)
+{
+    shards.ran_on[*(int *)data - SHARD_EVENTS] = pthread_self();
+    usleep(5000);
+    return fire_cb(data);
+}
+
+static void test_shards(void)
+{
+    pthread_t threads[SHARD_PRODUCERS];
+    int i, type, dels, bad, helpers;
+
+    for (type = SPD_SCHED_QUEUE_HEAP; type <= SPD_SCHED_QUEUE_WHEEL; type++) {
+        fire_reset();
+        memset(&shards, 0, sizeof(shards));
+        shards.sh = spd_sched_shards_create(4, type);
+        CHECK(spd_sched_shards_start(shards.sh) == 0);
+        for (i = 0; i < SHARD_PRODUCERS; i++)
+            pthread_create(&threads[i], NULL, shard_producer, (void *)(intptr_t)i);
+        for (i = 0; i < SHARD_PRODUCERS; i++)
+            pthread_join(threads[i], NULL);
+
+        /* ids lead back to their shard */
+        for (i = 0, dels = 0; i < SHARD_EVENTS; i++) {
+            CHECK(shards.ids[i] > 0);
+            if (!(i % 4) && !spd_sched_shards_del(shards.sh, shards.ids[i]))
+                dels++;
+        }
+        CHECK(dels == SHARD_EVENTS / 4);
+        CHECK(spd_sched_shards_when(shards.sh, shards.ids[1]) >= 0);
+        CHECK(spd_sched_shards_del(shards.sh, shards.ids[0]) == -1);
+
+        /* a backlog on one shard, 200ms of callbacks due at once, which idle shards help with */
+        for (i = SHARD_EVENTS; i < SHARD_EVENTS + SHARD_SLOW; i++)
+            CHECK(spd_sched_shards_add(shards.sh, 10, shard_slow_cb, fire_data(i)) > 0);
+
+        test_wait(SHARD_EVENTS - dels + SHARD_SLOW, 3000);
+        usleep(20000);
+        spd_sched_shards_stop(shards.sh);
+
+        CHECK(nfired == SHARD_EVENTS - dels + SHARD_SLOW);
+        for (i = 0, bad = 0; i < SHARD_EVENTS + SHARD_SLOW; i++)
+            bad += fired[i] != (i < SHARD_EVENTS && !(i % 4) ? 0 : 1);
+        CHECK(!bad);
+        for (i = 1, helpers = 0; i < SHARD_SLOW; i++)
+            helpers += !pthread_equal(shards.ran_on[i], shards.ran_on[0]);
+        CHECK(helpers > 0);
+        spd_sched_shards_destroy(shards.sh);
+    }
+}
+
+/*! \brief Whether fd polls readable within ms */
+static int test_readable(int fd, int ms)
+{
+    struct pollfd p = { fd, POLLIN, 0 };
+
+    return poll(&p, 1, ms) == 1 && (p.revents & POLLIN);
+}
+
+static void test_timerfd(void)
+{
+    struct scheduler_context *c;
+    spd_ns_t start;
+    int fd, type;
+
+    for (type = SPD_SCHED_QUEUE_HEAP; type <= SPD_SCHED_QUEUE_WHEEL; type++) {
+        fire_reset();
+        c = spd_sched_context_create_type(type);
+        CHECK((fd = spd_sched_get_fd(c)) >= 0);
+        CHECK(spd_sched_get_fd(c) == fd);
+        CHECK(!test_readable(fd, 0));
+
+        /* readable once the event is due, not before, and cleared by runall */
+        start = spd_nsnow();
+        CHECK(spd_sched_add_flag(c, 20, fire_cb, fire_data(0), 0, 1) > 0);
+        CHECK(test_readable(fd, 1000));
+        CHECK(spd_nsnow() >= start + 19 * SPD_NS_PER_MS);
+        CHECK(spd_sched_runall(c) == 1);
+        CHECK(!test_readable(fd, 0));
+
+        /* an earlier event pulls it in */
+        start = spd_nsnow();
+        CHECK(spd_sched_add_flag(c, 500, fire_cb, fire_data(1), 0, 1) > 0);
+        CHECK(spd_sched_add_flag(c, 10, fire_cb, fire_data(2), 0, 1) > 0);
+        CHECK(test_readable(fd, 1000));
+        CHECK(spd_nsnow() < start + (10 + TEST_LATE_MS) * SPD_NS_PER_MS);
+        CHECK(spd_sched_runall(c) == 1);
+        CHECK(fired[0] == 1 && fired[1] == 0 && fired[2] == 1);
+        spd_sche_context_destroy(c);
+    }
+}
+
+#define LOOP_TIMERS     5
+
+static struct {
+    struct scheduler_context *c;
+    int pipe[2];
+    int reads;
+    int res;
+} loop;
+
+/*! \brief Reads one byte per call, stops watching after the third */
+static int loop_fd_cb(int fd, int events, void *data)
+{
+    char b;
+
+    CHECK(data == &loop);
+    CHECK(events & EPOLLIN);
+    CHECK(read(fd, &b, 1) == 1);
+    return __atomic_add_fetch(&loop.reads, 1, __ATOMIC_RELAXED) < 3;
+}
+
+static void *loop_thread(void *arg)
+{
+    loop.res = spd_sched_loop_run(loop.c);
+    return arg;
+}
+
+static void test_loop(void)
+{
+    pthread_t thread;
+    spd_ns_t start;
+    int i, type, late;
+
+    for (type = SPD_SCHED_QUEUE_HEAP; type <= SPD_SCHED_QUEUE_WHEEL; type++) {
+        fire_reset();
+        memset(&loop, 0, sizeof(loop));
+        loop.c = spd_sched_context_create_type(type);
+        CHECK(pipe(loop.pipe) == 0);
+        CHECK(spd_sched_add_fd(loop.c, loop.pipe[0], EPOLLIN, loop_fd_cb, &loop) == 0);
+        loop.res = -2;
+        pthread_create(&thread, NULL, loop_thread, NULL);
+
+        /* timers added from this thread wake the loop, 10 to 50ms out */
+        start = spd_nsnow();
+        for (i = 0; i < LOOP_TIMERS; i++)
+            CHECK(spd_sched_add_flag(loop.c, 10 * (LOOP_TIMERS - i), fire_cb, fire_data(i), 0, 1) > 0);
+        for (i = 0; i < 4; i++) {
+            CHECK(write(loop.pipe[1], "x", 1) == 1);
+            usleep(5000);
+        }
+        test_wait(LOOP_TIMERS, 1000);
+        usleep(20000);
+        spd_sched_loop_stop(loop.c);
+        pthread_join(thread, NULL);
+
+        CHECK(loop.res == 0);
+        CHECK(nfired == LOOP_TIMERS);
+        for (i = 0, late = 0; i < LOOP_TIMERS; i++) {
+            if (fired[i] != 1 || fired_at[i] < start + (10 * (LOOP_TIMERS - i) - 1) * SPD_NS_PER_MS ||
+                fired_at[i] > start + (10 * (LOOP_TIMERS - i) + TEST_LATE_MS) * SPD_NS_PER_MS)
+                late++;
+        }
+        CHECK(!late);
+        /* the fourth byte came after the callback asked to stop watching */
+        CHECK(loop.reads == 3);
+        CHECK(spd_sched_del_fd(loop.c, loop.pipe[0]) == -1);
+        close(loop.pipe[0]);
+        close(loop.pipe[1]);
+        spd_sche_context_destroy(loop.c);
+    }
+}
+
+#define RESERVE_EVENTS  5000
+
+static int noop_cb(void *data)
+{
+    (void)data;
+    return 0;
+}
+
+static void test_reserve_trim(void)
+{
+    static int ids[RESERVE_EVENTS];
+    struct scheduler_context *c;
+    struct spd_sched_mem m1, m2, m3;
+#ifdef MALLOC_DEBUG
+    struct spd_mem_stats a, b;
+#endif
+    int i, type, bad;
+
+    for (type = SPD_SCHED_QUEUE_HEAP; type <= SPD_SCHED_QUEUE_WHEEL; type++) {
+        c = spd_sched_context_create_type(type);
+        /* the first event of a thread sets up its magazine */
+        CHECK(spd_sched_del(c, spd_sched_add_flag(c, 1000, noop_cb, NULL, 0, 1)) == 0);
+        CHECK(spd_sched_reserve(c, RESERVE_EVENTS) == 0);
+        CHECK(spd_sched_reserve(c, UINT_MAX) == -1);
+        spd_sched_get_mem(c, &m1);
+
+        /* reserved: adding them allocates nothing */
+#ifdef MALLOC_DEBUG
+        spd_mem_get_stats(&a);
+#endif
+        for (i = 0, bad = 0; i < RESERVE_EVENTS; i++)
+            bad += (ids[i] = spd_sched_add_flag(c, 1000 + i, noop_cb, NULL, 0, 1)) <= 0;
+        CHECK(!bad);
+#ifdef MALLOC_DEBUG
+        spd_mem_get_stats(&b);
+        CHECK(b.allocs == a.allocs);
+#endif
+        spd_sched_get_mem(c, &m2);
+
+        /* trimmed: the tables shrink back below what the reserve made them */
+        for (i = 0, bad = 0; i < RESERVE_EVENTS; i++)
+            bad += spd_sched_del(c, ids[i]) != 0;
+        CHECK(!bad);
+        spd_sched_trim(c);
+        spd_sched_get_mem(c, &m3);
+#ifdef MALLOC_DEBUG
+        CHECK(m2.bytes > m1.bytes);
+        CHECK(m3.bytes < m1.bytes);
+#endif
+        CHECK(spd_sched_add_flag(c, 10, noop_cb, NULL, 0, 1) > 0);
+        spd_sche_context_destroy(c);
+    }
+}
+
+/* destructors run once, when the event is finally freed */
+
+static int destroyed[5];
+static int again_calls, again_early;
+static char inline_seen[SPD_SCHED_INLINE_DATA];
+static const void *inline_at;
+
+static void destroy_cb(void *data)
+{
+    destroyed[*(int *)data]++;
+}
+
+/*! \brief Recurs twice, its data must outlive every run */
+static int again_cb(void *data)
+{
+    again_early += destroyed[*(int *)data];
+    return ++again_calls < 3;
+}
+
+static int inline_cb(void *data)
+{
+    inline_at = data;
+    memcpy(inline_seen, data, sizeof(inline_seen));
+    return 0;
+}
+
+static void test_add_destroy(void)
+{
+    static int keys[5] = { 0, 1, 2, 3, 4 };
+    char payload[SPD_SCHED_INLINE_DATA + 1];
+    struct scheduler_context *c;
+    spd_ns_t end;
+    int type, id;
+
+    for (type = SPD_SCHED_QUEUE_HEAP; type <= SPD_SCHED_QUEUE_WHEEL; type++) {
+        memset(destroyed, 0, sizeof(destroyed));
+        again_calls = again_early = 0;
+        inline_at = NULL;
+        fire_reset();
+        c = spd_sched_context_create_type(type);
+
+        CHECK(spd_sched_add_destroy(c, 5, fire_cb, &keys[0], destroy_cb, 0, 1) > 0);
+        id = spd_sched_add_destroy(c, 1000, fire_cb, &keys[1], destroy_cb, 0, 1);
+        CHECK(id > 0);
+        CHECK(spd_sched_add_destroy(c, 1000, fire_cb, &keys[2], destroy_cb, 0, 1) > 0);
+        CHECK(spd_sched_add_destroy(c, 5, again_cb, &keys[3], destroy_cb, 0, -1) > 0);
+        /* no destructor: the static data must be left alone */
+        CHECK(spd_sched_add_destroy(c, 5, fire_cb, &keys[4], NULL, 0, 1) > 0);
+
+        memset(payload, 'a', sizeof(payload));
+        CHECK(spd_sched_add_inline(c, 5, inline_cb, payload, SPD_SCHED_INLINE_DATA + 1, 0, 1) == -1);
+        CHECK(spd_sched_add_inline(c, 5, inline_cb, payload, SPD_SCHED_INLINE_DATA, 0, 1) > 0);
+        memset(payload, 'b', sizeof(payload));
+
+        CHECK(spd_sched_del(c, id) == 0);
+        CHECK(destroyed[1] == 1);
+
+        end = spd_nsnow() + 500 * SPD_NS_PER_MS;
+        while ((nfired < 2 || again_calls < 3 || !inline_at) && spd_nsnow() < end) {
+            usleep(1000);
+            spd_sched_runall(c);
+        }
+        CHECK(fired[0] == 1 && destroyed[0] == 1);
+        CHECK(again_calls == 3 && !again_early && destroyed[3] == 1);
+        CHECK(fired[4] == 1 && !destroyed[4]);
+        CHECK(inline_at && inline_at != payload);
+        CHECK(inline_seen[0] == 'a' && inline_seen[SPD_SCHED_INLINE_DATA - 1] == 'a');
+        CHECK(!destroyed[2]);
+
+        spd_sche_context_destroy(c);
+        CHECK(destroyed[0] == 1 && destroyed[1] == 1 && destroyed[2] == 1 && destroyed[3] == 1);
+        CHECK(!destroyed[4] && !fired[1] && !fired[2]);
+    }
+}
+
+#define MEM_EVENTS      1000
+
+static void test_get_mem(void)
+{
+    static int ids[MEM_EVENTS];
+    struct scheduler_context *c;
+    struct spd_sched_mem m0, m1, m2;
+    struct spd_mem_stats a, b;
+    int i, type, bad;
+
+    for (type = SPD_SCHED_QUEUE_HEAP; type <= SPD_SCHED_QUEUE_WHEEL; type++) {
+        c = spd_sched_context_create_type(type);
+        CHECK(spd_sched_get_mem(c, &m0) == 0);
+        CHECK(m0.bytes > 0 && m0.peak >= m0.bytes);
+
+        for (i = 0, bad = 0; i < MEM_EVENTS; i++)
+            bad += (ids[i] = spd_sched_add(c, 1000, noop_cb, NULL)) <= 0;
+        CHECK(!bad);
+        spd_sched_get_mem(c, &m1);
+        CHECK(m1.bytes > m0.bytes && m1.peak >= m1.bytes);
+
+        for (i = 0, bad = 0; i < MEM_EVENTS; i++)
+            bad += spd_sched_del(c, ids[i]) != 0;
+        CHECK(!bad);
+        spd_sched_trim(c);
+        spd_sched_get_mem(c, &m2);
+        CHECK(m2.bytes < m1.bytes && m2.peak >= m1.bytes);
+
+        /* the data the caller malloc'd is freed past the counters */
+        CHECK(spd_sched_reserve(c, MEM_EVENTS) == 0);
+        spd_mem_get_stats(&a);
+        for (i = 0, bad = 0; i < MEM_EVENTS; i++)
+            bad += spd_sched_del(c, spd_sched_add(c, 1000, fire_cb, fire_data(i))) != 0;
+        CHECK(!bad);
+        spd_mem_get_stats(&b);
+        CHECK(b.allocs == a.allocs && b.frees == a.frees && b.bytes == a.bytes);
+        CHECK(b.frees <= b.allocs && b.bytes >= 0 && b.peak >= b.bytes);
+
+        spd_sche_context_destroy(c);
+    }
+}
+
+static int retry_cb(void *data)
+{
+    (void)data;
+    return 1;
+}
+
+static int slow_noop_cb(void *data)
+{
+    (void)data;
+    usleep(20000);
+    return 0;
+}
+
+/*! \brief Number of values in a histogram */
+static uint64_t hist_count(const struct spd_sched_hist *h)
+{
+    uint64_t n = 0;
+    int i;
+
+    for (i = 0; i < SPD_SCHED_HIST_BUCKETS; i++)
+        n += h->count[i];
+    return n;
+}
+
+static void test_get_stats(void)
+{
+    struct scheduler_context *c;
+    struct spd_sched_stats st;
+    int i, type, ids[5];
+    spd_ns_t end;
+
+    for (type = SPD_SCHED_QUEUE_HEAP; type <= SPD_SCHED_QUEUE_WHEEL; type++) {
+        c = spd_sched_context_create_type(type);
+        for (i = 0; i < 10; i++)
+            spd_sched_add(c, 5, noop_cb, NULL);
+        for (i = 0; i < 5; i++)
+            ids[i] = spd_sched_add(c, 1000, noop_cb, NULL);
+        /* runs three times: two reschedules, then it is out of retries */
+        spd_sched_add_flag(c, 5, retry_cb, NULL, 0, 3);
+        spd_sched_add(c, 5, slow_noop_cb, NULL);
+        for (i = 0; i < 3; i++)
+            spd_sched_del(c, ids[i]);
+        spd_sched_mod(c, ids[3], 2000);
+
+        end = spd_nsnow() + 1000 * SPD_NS_PER_MS;
+        do {
+            usleep(1000);
+            spd_sched_runall(c);
+            CHECK(spd_sched_get_stats(c, &st) == 0);
+        } while (st.fires < 14 && spd_nsnow() < end);
+
+        CHECK(st.adds == 17 && st.dels == 3 && st.mods == 1);
+        CHECK(st.fires == 14 && st.reschedules == 2 && st.exhausted == 1);
+        CHECK(st.depth == 2 && st.depthmax >= 17);
+        CHECK(hist_count(&st.lateness) == 14 && hist_count(&st.runtime) == 14);
+        CHECK(st.runtime.max >= 20000 && st.runtime.sum >= st.runtime.max);
+        CHECK(spd_sched_hist_percentile(&st.runtime, 100) >= 16000);
+        CHECK(spd_sched_hist_percentile(&st.runtime, 50) < 16000);
+        spd_sche_context_destroy(c);
+    }
+}
+
+#define SLACK_EVENTS    20
+
+/*! \brief Runs the context like a dispatcher until n events fired, returns the passes that ran any */
+static int test_dispatch(struct scheduler_context *c, int n)
+{
+    spd_ns_t end = spd_nsnow() + 2 * SPD_NS_PER_SEC;
+    int passes = 0;
+
+    while (nfired < n && spd_nsnow() < end) {
+        spd_sched_cond_wait(c);
+        if (spd_sched_runall(c) > 0)
+            passes++;
+    }
+    return passes;
+}
+
+static void test_slack(void)
+{
+    struct scheduler_context *c;
+    spd_ns_t start;
+    int i, type, slack, passes, late;
+
+    for (type = SPD_SCHED_QUEUE_HEAP; type <= SPD_SCHED_QUEUE_WHEEL; type++) {
+        /* 2ms apart: one wakeup each when exact, a few shared ones with 50ms of slack */
+        for (slack = 0; slack <= 50; slack += 50) {
+            fire_reset();
+            c = spd_sched_context_create_type(type);
+            start = spd_nsnow();
+            for (i = 0; i < SLACK_EVENTS; i++)
+                CHECK(spd_sched_add_slack(c, 100 + 2 * i, slack, fire_cb, fire_data(i), 0, 1) > 0);
+            passes = test_dispatch(c, SLACK_EVENTS);
+            CHECK(nfired == SLACK_EVENTS);
+            for (i = 0, late = 0; i < SLACK_EVENTS; i++) {
+                if (fired_at[i] < start + (100 + 2 * i - 1) * SPD_NS_PER_MS ||
+                    fired_at[i] > start + (100 + 2 * i + slack + TEST_LATE_MS) * SPD_NS_PER_MS)
+                    late++;
+            }
+            CHECK(!late);
+            if (slack)
+                CHECK(passes <= 3);
+            else
+                CHECK(passes >= SLACK_EVENTS / 2);
+            spd_sche_context_destroy(c);
+        }
+    }
+
+    c = spd_sched_context_create();
+    CHECK(spd_sched_add_slack(c, 100, -1, fire_cb, NULL, 0, 1) == -1);
+    spd_sche_context_destroy(c);
+}
+
+/* periodic events falling behind their grid */
+
+#define TICK_RUNS       7
+#define TICK_PERIOD     10
+
+static struct {
+    spd_ns_t at[TICK_RUNS];
+    unsigned int missed[TICK_RUNS];
+    int runs;
+} tick;
+
+/*! \brief Every 10ms, the third run takes 33ms so the ticks due at 40, 50 and 60ms are missed */
+static int tick_cb(void *data, unsigned int missed)
+{
+    (void)data;
+    tick.at[tick.runs] = spd_nsnow();
+    tick.missed[tick.runs] = missed;
+    if (tick.runs == 2)
+        usleep(33000);
+    return ++tick.runs < TICK_RUNS;
+}
+
+static void test_tick(struct scheduler_context *c, enum spd_sched_period mode, enum spd_sched_catchup catchup,
+    spd_ns_t *start)
+{
+    spd_ns_t end;
+
+    memset(&tick, 0, sizeof(tick));
+    *start = spd_nsnow();
+    end = *start + 2 * SPD_NS_PER_SEC;
+    CHECK(spd_sched_add_periodic(c, 0, TICK_PERIOD, mode, catchup, tick_cb, NULL) > 0);
+    while (tick.runs < TICK_RUNS && spd_nsnow() < end) {
+        spd_sched_cond_wait(c);
+        spd_sched_runall(c);
+    }
+    CHECK(tick.runs == TICK_RUNS);
+}
+
+/*! \brief Whether run i of the last test_tick() started at ms after start, give or take a loaded machine */
+static int tick_at(int i, spd_ns_t start, int ms)
+{
+    return tick.at[i] >= start + (ms - 1) * SPD_NS_PER_MS && tick.at[i] <= start + (ms + TEST_LATE_MS) * SPD_NS_PER_MS;
+}
+
+static void test_periodic(void)
+{
+    static const unsigned int skip[TICK_RUNS] = { 0, 0, 0, 3, 0, 0, 0 };
+    static const unsigned int coalesce[TICK_RUNS] = { 0, 0, 0, 2, 0, 0, 0 };
+    struct scheduler_context *c;
+    spd_ns_t start;
+    int i, type;
+
+    for (type = SPD_SCHED_QUEUE_HEAP; type <= SPD_SCHED_QUEUE_WHEEL; type++) {
+        c = spd_sched_context_create_type(type);
+
+        /* the ticks at 40, 50 and 60ms are dropped, the grid goes on at 70ms */
+        test_tick(c, SPD_SCHED_FIXED_RATE, SPD_SCHED_CATCHUP_SKIP, &start);
+        CHECK(!memcmp(tick.missed, skip, sizeof(skip)));
+        CHECK(tick_at(3, start, 70));
+        CHECK(tick_at(6, start, 100));
+
+        /* one run at once for all three, then 70ms */
+        test_tick(c, SPD_SCHED_FIXED_RATE, SPD_SCHED_CATCHUP_COALESCE, &start);
+        CHECK(!memcmp(tick.missed, coalesce, sizeof(coalesce)));
+        CHECK(tick.at[3] < start + 70 * SPD_NS_PER_MS);
+        CHECK(tick_at(4, start, 70));
+        CHECK(tick_at(6, start, 90));
+
+        /* all three back to back right after the long run, then 70ms */
+        test_tick(c, SPD_SCHED_FIXED_RATE, SPD_SCHED_CATCHUP_BURST, &start);
+        for (i = 0; i < TICK_RUNS; i++)
+            CHECK(!tick.missed[i]);
+        CHECK(tick.at[5] - tick.at[3] < 5 * SPD_NS_PER_MS);
+        CHECK(tick.at[5] < tick.at[2] + (33 + TICK_PERIOD) * SPD_NS_PER_MS);
+        CHECK(tick_at(6, start, 70));
+
+        /* the long run pushes the rest back, one period after it ended */
+        test_tick(c, SPD_SCHED_FIXED_DELAY, SPD_SCHED_CATCHUP_SKIP, &start);
+        for (i = 0; i < TICK_RUNS; i++)
+            CHECK(!tick.missed[i]);
+        CHECK(tick.at[3] >= tick.at[2] + (33 + TICK_PERIOD - 1) * SPD_NS_PER_MS);
+        for (i = 4; i < TICK_RUNS; i++)
+            CHECK(tick.at[i] >= tick.at[i - 1] + (TICK_PERIOD - 1) * SPD_NS_PER_MS);
+        CHECK(tick.at[6] > start + 100 * SPD_NS_PER_MS);
+        spd_sche_context_destroy(c);
+    }
+}
+
+/* events moved while the dispatcher sleeps */
+
+static struct {
+    struct scheduler_context *c;
+    int id[3];
+    spd_sched_handle_t handle;
+    int res[4];
+} mod;
+
+static void *mod_thread(void *arg)
+{
+    usleep(10000);
+    mod.res[0] = spd_sched_mod(mod.c, mod.id[0], 20);
+    mod.res[1] = spd_sched_mod(mod.c, mod.id[1], 290);
+    mod.res[2] = spd_sched_mod_handle(mod.c, mod.handle, 140);
+    mod.res[3] = spd_sched_mod(mod.c, mod.id[2], -1);
+    return arg;
+}
+
+static void test_mod(void)
+{
+    static const int order[] = { 0, 2, 3, 1 };
+    static const int due[] = { 30, 300, 100, 150 };
+    pthread_t thread;
+    spd_ns_t start;
+    int i, type, late;
+
+    for (type = SPD_SCHED_QUEUE_HEAP; type <= SPD_SCHED_QUEUE_WHEEL; type++) {
+        fire_reset();
+        memset(&mod, 0, sizeof(mod));
+        mod.c = spd_sched_context_create_type(type);
+        start = spd_nsnow();
+        mod.id[0] = spd_sched_add_flag(mod.c, 1000, fire_cb, fire_data(0), 0, 1);
+        mod.id[1] = spd_sched_add_flag(mod.c, 200, fire_cb, fire_data(1), 0, 1);
+        mod.id[2] = spd_sched_add_flag(mod.c, 100, fire_cb, fire_data(2), 0, 1);
+        mod.handle = spd_sched_add_handle(mod.c, 400, fire_cb, fire_data(3), 0, 1);
+
+        /* the dispatcher sleeps until 100ms when the first event is moved up to 30ms */
+        pthread_create(&thread, NULL, mod_thread, NULL);
+        test_dispatch(mod.c, 4);
+        pthread_join(thread, NULL);
+
+        CHECK(!mod.res[0] && !mod.res[1] && !mod.res[2]);
+        CHECK(mod.res[3] == -1);
+        CHECK(nfired == 4);
+        CHECK(!memcmp(fired_order, order, sizeof(order)));
+        for (i = 0, late = 0; i < 4; i++) {
+            if (fired_at[i] < start + (due[i] - 1) * SPD_NS_PER_MS || fired_at[i] > start + (due[i] + TEST_LATE_MS) * SPD_NS_PER_MS)
+                late++;
+        }
+        CHECK(!late);
+        CHECK(spd_sched_mod(mod.c, mod.id[0], 10) == -1);
+        CHECK(spd_sched_mod_handle(mod.c, mod.handle, 10) == -1);
+        spd_sche_context_destroy(mod.c);
+    }
+}
+
+/* recurring events which already ran in a runall batch */
+
+static struct {
+    struct scheduler_context *c;
+    int id[3];
+    int runs[3];
+    int del, mod;
+    long when;
+} batch;
+
+static int batch_cb(void *data)
+{
+    int i = *(int *)data;
+
+    batch.runs[i]++;
+    return 3000;
+}
+
+/*! \brief Runs after its three siblings in the same batch, while they wait to be requeued */
+static int batch_poke_cb(void *data)
+{
+    (void)data;
+    batch.del = spd_sched_del(batch.c, batch.id[0]);
+    batch.when = spd_sched_when(batch.c, batch.id[1]);
+    batch.mod = spd_sched_mod(batch.c, batch.id[2], 10);
+    return 0;
+}
+
+static void test_batch_lookup(void)
+{
+    spd_ns_t start;
+    int i, type;
+
+    for (type = SPD_SCHED_QUEUE_HEAP; type <= SPD_SCHED_QUEUE_WHEEL; type++) {
+        memset(&batch, 0, sizeof(batch));
+        batch.c = spd_sched_context_create_type(type);
+        for (i = 0; i < 3; i++)
+            batch.id[i] = spd_sched_add_inline(batch.c, 5, batch_cb, &i, sizeof(i), 1, -1);
+        spd_sched_add(batch.c, 6, batch_poke_cb, NULL);
+
+        /* all four are due by now, one runall pass takes them in one batch */
+        usleep(20000);
+        CHECK(spd_sched_runall(batch.c) == 4);
+        CHECK(batch.del == 0);
+        CHECK(batch.when >= 2 && batch.when <= 3);
+        CHECK(batch.mod == 0);
+
+        start = spd_nsnow();
+        while (batch.runs[2] < 2 && spd_nsnow() < start + 500 * SPD_NS_PER_MS) {
+            usleep(1000);
+            spd_sched_runall(batch.c);
+        }
+        CHECK(batch.runs[2] == 2);
+        CHECK(spd_nsnow() - start < (10 + TEST_LATE_MS) * SPD_NS_PER_MS);
+        CHECK(spd_sched_when(batch.c, batch.id[0]) == -1);
+        CHECK(spd_sched_when(batch.c, batch.id[1]) >= 2);
+        CHECK(batch.runs[0] == 1 && batch.runs[1] == 1);
+        spd_sche_context_destroy(batch.c);
+    }
+}
+
+static const struct {
+    const char *name;
+    void (*fn)(void);
+} tests[] = {
+    { "heap_wheel_order", test_heap_wheel_order },
+    { "batch_lookup", test_batch_lookup },
+    { "handles", test_handles },
+    { "lockfree_inbox", test_lockfree_inbox },
+    { "add_batch", test_add_batch },
+    { "worker_pool", test_worker_pool },
+    { "shards", test_shards },
+    { "timerfd", test_timerfd },
+    { "loop", test_loop },
+    { "reserve_trim", test_reserve_trim },
+    { "add_destroy", test_add_destroy },
+    { "get_mem", test_get_mem },
+    { "get_stats", test_get_stats },
+    { "slack", test_slack },
+    { "periodic", test_periodic },
+    { "mod", test_mod },
+};
+
+int main(int argc, char **argv)
+{
+    unsigned int i;
+    int before;
+
+    if (argc > 1 && !strcmp(argv[1], "demo")) {
+        demo();
+        return 0;
+    }
+    for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        before = failures;
+        tests[i].fn();
+        printf("%-24s %s\n", tests[i].name, failures == before ? "ok" : "FAIL");
+    }
+    return failures ? 1 : 0;
+}
+
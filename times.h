@@ -14,6 +14,7 @@
 #define _SPIDER_TIMES_H
 
 #include <sys/time.h>
+#include <time.h>
 
 #if defined (__cplusplus) || defined(c_plusplus)
 extern "C" {
@@ -150,6 +151,80 @@ struct timeval spd_tvsub(struct timeval a, struct timeval b);
 
 struct timeval spd_tvadd(struct timeval a, struct timeval b);
 
+/*!
+ * \brief A point in time or a duration, in nanoseconds.
+ * Points in time are read from CLOCK_MONOTONIC, so they do not jump
+ * when the wall clock is set, and they add and compare as plain
+ * integers. The \c struct \c timeval helpers above are kept for
+ * compatibility, the scheduler itself runs on this time base.
+ */
+typedef int64_t spd_ns_t;
+
+#define SPD_NS_PER_US   1000LL
+#define SPD_NS_PER_MS   1000000LL
+#define SPD_NS_PER_SEC  1000000000LL
+
+/*!
+ *\brief get current monotonic time
+ */
+static inline spd_ns_t spd_nsnow(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+
+	return (spd_ns_t)t.tv_sec * SPD_NS_PER_SEC + t.tv_nsec;
+}
+
+/*!
+ * \brief Returns the duration of 'ms' milliseconds
+ */
+static inline spd_ns_t spd_ms2ns(int64_t ms)
+{
+	return ms * SPD_NS_PER_MS;
+}
+
+/*!
+ * \brief Computes the difference (in milliseconds) between two points in time,
+ * rounded towards minus infinity like spd_tvdiff_ms().
+ */
+static inline int64_t spd_nsdiff_ms(spd_ns_t end, spd_ns_t start)
+{
+	spd_ns_t d = end - start;
+
+	return (d - (d < 0) * (SPD_NS_PER_MS - 1)) / SPD_NS_PER_MS;
+}
+
+/*!
+ * \brief Converts a point in time to the \c struct \c timespec of
+ * the same CLOCK_MONOTONIC instant, as taken by clock_nanosleep() and
+ * by condition variables set up with pthread_condattr_setclock().
+ */
+static inline struct timespec spd_ns2ts(spd_ns_t t)
+{
+	struct timespec ts;
+
+	ts.tv_sec = t / SPD_NS_PER_SEC;
+	ts.tv_nsec = t % SPD_NS_PER_SEC;
+
+	return ts;
+}
+
+/*!
+ * \brief Converts a duration to a \c struct \c timeval
+ */
+static inline struct timeval spd_ns2tv(spd_ns_t t)
+{
+	return spd_tv(t / SPD_NS_PER_SEC, (t % SPD_NS_PER_SEC) / SPD_NS_PER_US);
+}
+
+/*!
+ * \brief Converts a \c struct \c timeval duration to nanoseconds
+ */
+static inline spd_ns_t spd_tv2ns(struct timeval tv)
+{
+	return (spd_ns_t)tv.tv_sec * SPD_NS_PER_SEC + (spd_ns_t)tv.tv_usec * SPD_NS_PER_US;
+}
+
 #if defined (__cplusplus) || defined(c_plusplus)
 }
 #endif